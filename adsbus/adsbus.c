@@ -1,6 +1,10 @@
 #include <stdlib.h>
 
+#include "aircraft.h"
 #include "beast.h"
+#include "compact.h"
+#include "crc.h"
+#include "dedup.h"
 #include "exec.h"
 #include "file.h"
 #include "hex.h"
@@ -17,6 +21,7 @@
 #include "send.h"
 #include "send_receive.h"
 #include "server.h"
+#include "source.h"
 #include "stats.h"
 #include "stdinout.h"
 #include "wakeup.h"
@@ -30,6 +35,7 @@ static void adsbus_opts_add() {
 	exec_opts_add();
 	file_opts_add();
 	stdinout_opts_add();
+	send_opts_add();
 }
 
 int main(int argc, char *argv[]) {
@@ -40,10 +46,14 @@ int main(int argc, char *argv[]) {
 	opts_init(argc, argv);
 
 	hex_init();
+	crc_init();
+	dedup_init();
+	aircraft_init();
 	rand_init();
 
 	log_init();
 	server_init();
+	source_init();
 
 	resolve_init();
 	wakeup_init();
@@ -55,6 +65,7 @@ int main(int argc, char *argv[]) {
 	send_init();
 
 	beast_init();
+	compact_init();
 	json_init();
 	proto_init();
 	stats_init();
@@ -77,8 +88,9 @@ int main(int argc, char *argv[]) {
 	exec_cleanup();
 	file_cleanup();
 
-	json_cleanup();
-	proto_cleanup();
+	source_cleanup();
+	crc_cleanup();
+	aircraft_cleanup();
 
 	rand_cleanup();
 	wakeup_cleanup();
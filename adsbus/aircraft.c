@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc.h"
+#include "packet.h"
+
+#include "aircraft.h"
+
+// Per-aircraft state decoded from the packets passing through, with
+// ADSBUS_AIRCRAFT=on. DF17/18 frames with good parity create entries and
+// carry identification, altitude, velocity and squawk; DF5/21 identity
+// replies update squawk for aircraft we already know, since their address
+// is only as good as the parity guess.
+
+#define AIRCRAFT_BITS_MIN 10
+#define AIRCRAFT_TTL_S 60
+// One-second slots; must cover AIRCRAFT_TTL_S
+#define AIRCRAFT_WHEEL_SLOTS 64
+
+static bool aircraft_on = false;
+static struct aircraft *aircraft_table = NULL;
+static unsigned aircraft_bits = 0;
+static size_t aircraft_num = 0;
+// Each slot lists aircraft due to expire in that second, linked by key so
+// that entries can move within the table. Updates don't move an entry;
+// when its slot comes up, it's either expired or rescheduled.
+static uint32_t aircraft_wheel[AIRCRAFT_WHEEL_SLOTS];
+static uint64_t aircraft_wheel_s = 0;
+
+static char aircraft_charset[] = "#ABCDEFGHIJKLMNOPQRSTUVWXYZ##### ###############0123456789######";
+
+static size_t aircraft_slot(uint32_t key) {
+	return (size_t) ((key * 0x9e3779b1U) >> (32 - aircraft_bits));
+}
+
+static struct aircraft *aircraft_find(uint32_t key) {
+	size_t mask = ((size_t) 1 << aircraft_bits) - 1;
+	for (size_t i = aircraft_slot(key);; i = (i + 1) & mask) {
+		struct aircraft *aircraft = &aircraft_table[i];
+		if (!aircraft->key || aircraft->key == key) {
+			return aircraft;
+		}
+	}
+}
+
+static void aircraft_alloc(unsigned bits) {
+	size_t size = (size_t) 1 << bits;
+	aircraft_table = aligned_alloc(sizeof(*aircraft_table), size * sizeof(*aircraft_table));
+	assert(aircraft_table);
+	memset(aircraft_table, 0, size * sizeof(*aircraft_table));
+	aircraft_bits = bits;
+}
+
+static void aircraft_resize() {
+	size_t old_size = (size_t) 1 << aircraft_bits;
+	struct aircraft *old_table = aircraft_table;
+	aircraft_alloc(aircraft_bits + 1);
+	for (size_t i = 0; i < old_size; i++) {
+		if (old_table[i].key) {
+			*aircraft_find(old_table[i].key) = old_table[i];
+		}
+	}
+	free(old_table);
+}
+
+static void aircraft_del(struct aircraft *aircraft) {
+	// Backward shift: pull later entries of the probe run into the hole if
+	// their home slot allows it, so lookups never need tombstones.
+	size_t mask = ((size_t) 1 << aircraft_bits) - 1;
+	size_t hole = (size_t) (aircraft - aircraft_table);
+	for (size_t i = (hole + 1) & mask; aircraft_table[i].key; i = (i + 1) & mask) {
+		size_t home = aircraft_slot(aircraft_table[i].key);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			aircraft_table[hole] = aircraft_table[i];
+			hole = i;
+		}
+	}
+	memset(&aircraft_table[hole], 0, sizeof(*aircraft_table));
+	aircraft_num--;
+}
+
+static void aircraft_schedule(struct aircraft *aircraft) {
+	uint32_t *head = &aircraft_wheel[(aircraft->seen_ms / 1000 + AIRCRAFT_TTL_S) % AIRCRAFT_WHEEL_SLOTS];
+	aircraft->wheel_next = *head;
+	*head = aircraft->key;
+}
+
+static void aircraft_expire(uint64_t now_s) {
+	if (!aircraft_wheel_s) {
+		aircraft_wheel_s = now_s;
+		return;
+	}
+	// After a long gap, one lap gives every slot its turn
+	uint64_t first_s = aircraft_wheel_s + 1;
+	if (now_s - aircraft_wheel_s > AIRCRAFT_WHEEL_SLOTS) {
+		first_s = now_s - AIRCRAFT_WHEEL_SLOTS + 1;
+	}
+	for (uint64_t s = first_s; s <= now_s; s++) {
+		uint32_t *head = &aircraft_wheel[s % AIRCRAFT_WHEEL_SLOTS];
+		uint32_t key = *head;
+		*head = 0;
+		while (key) {
+			struct aircraft *aircraft = aircraft_find(key);
+			assert(aircraft->key);
+			key = aircraft->wheel_next;
+			if (aircraft->seen_ms / 1000 + AIRCRAFT_TTL_S <= s) {
+				aircraft_del(aircraft);
+			} else {
+				aircraft_schedule(aircraft);
+			}
+		}
+	}
+	aircraft_wheel_s = now_s;
+}
+
+static struct aircraft *aircraft_touch(uint32_t icao, uint64_t now_ms) {
+	uint32_t key = icao | AIRCRAFT_USED;
+	struct aircraft *aircraft = aircraft_find(key);
+	if (!aircraft->key) {
+		if ((aircraft_num + 1) * 2 > (size_t) 1 << aircraft_bits) {
+			aircraft_resize();
+			aircraft = aircraft_find(key);
+		}
+		memset(aircraft, 0, sizeof(*aircraft));
+		aircraft->key = key;
+		aircraft->seen_ms = now_ms;
+		aircraft_schedule(aircraft);
+		aircraft_num++;
+	}
+	aircraft->seen_ms = now_ms;
+	aircraft->messages++;
+	return aircraft;
+}
+
+static uint32_t aircraft_me_bits(uint64_t me, unsigned first, unsigned len) {
+	// Bits are numbered from 1, MSB first, as in DO-260
+	return (uint32_t) (me >> (56 - first - len + 1)) & ((1U << len) - 1);
+}
+
+static uint16_t aircraft_squawk(uint32_t id13) {
+	// C1 A1 C2 A2 C4 A4 X B1 D1 B2 D2 B4 D4
+	static const uint16_t digit_bits[13] = {
+		0x0010, 0x1000, 0x0020, 0x2000, 0x0040, 0x4000, 0, 0x0100, 0x0001, 0x0200, 0x0002, 0x0400, 0x0004,
+	};
+	uint16_t squawk = 0;
+	for (int i = 0; i < 13; i++) {
+		if (id13 & (0x1000U >> i)) {
+			squawk |= digit_bits[i];
+		}
+	}
+	return squawk;
+}
+
+static void aircraft_decode_es(struct aircraft *aircraft, const uint8_t *payload) {
+	uint64_t me = 0;
+	for (int i = 4; i < 11; i++) {
+		me = (me << 8) | payload[i];
+	}
+	uint32_t tc = aircraft_me_bits(me, 1, 5);
+	uint32_t st = aircraft_me_bits(me, 6, 3);
+
+	if (tc >= 1 && tc <= 4) {
+		for (unsigned i = 0; i < 8; i++) {
+			aircraft->callsign[i] = aircraft_charset[aircraft_me_bits(me, 9 + i * 6, 6)];
+		}
+		aircraft->callsign[8] = '\0';
+		aircraft->category = (uint8_t) ((tc << 4) | st);
+		aircraft->fields |= AIRCRAFT_CALLSIGN;
+	} else if (tc >= 9 && tc <= 18) {
+		uint32_t alt = aircraft_me_bits(me, 9, 12);
+		// Only the 25 ft (Q bit) encoding; Gillham altitudes are left alone
+		if (alt & 0x10) {
+			uint32_t n = ((alt & 0xfe0) >> 1) | (alt & 0x0f);
+			aircraft->altitude_ft = (int32_t) n * 25 - 1000;
+			aircraft->fields |= AIRCRAFT_ALTITUDE;
+		}
+	} else if (tc == 19 && st >= 1 && st <= 4) {
+		if (st <= 2) {
+			uint32_t ew = aircraft_me_bits(me, 15, 10);
+			uint32_t ns = aircraft_me_bits(me, 26, 10);
+			if (ew && ns) {
+				int16_t scale = st == 2 ? 4 : 1;
+				aircraft->velocity_ew_kt = (int16_t) ((int16_t) (ew - 1) * scale * (aircraft_me_bits(me, 14, 1) ? -1 : 1));
+				aircraft->velocity_ns_kt = (int16_t) ((int16_t) (ns - 1) * scale * (aircraft_me_bits(me, 25, 1) ? -1 : 1));
+				aircraft->fields |= AIRCRAFT_VELOCITY;
+			}
+		}
+		uint32_t vr = aircraft_me_bits(me, 38, 9);
+		if (vr) {
+			aircraft->vertical_rate_fpm = (int16_t) ((int16_t) (vr - 1) * 64 * (aircraft_me_bits(me, 37, 1) ? -1 : 1));
+			aircraft->fields |= AIRCRAFT_VERTICAL_RATE;
+		}
+	} else if (tc == 28 && st == 1) {
+		aircraft->squawk = aircraft_squawk(aircraft_me_bits(me, 12, 13));
+		aircraft->fields |= AIRCRAFT_SQUAWK;
+	}
+}
+
+void aircraft_init() {
+	char *on = getenv("ADSBUS_AIRCRAFT");
+	if (on) {
+		assert(!strcmp(on, "on") || !strcmp(on, "off"));
+		aircraft_on = !strcmp(on, "on");
+	}
+	if (aircraft_on) {
+		aircraft_alloc(AIRCRAFT_BITS_MIN);
+	}
+}
+
+void aircraft_cleanup() {
+	free(aircraft_table);
+}
+
+bool aircraft_enabled() {
+	return aircraft_on;
+}
+
+void aircraft_update(const struct packet *packet, uint64_t now_ms) {
+	aircraft_expire(now_ms / 1000);
+
+	if (packet->type != PACKET_TYPE_MODE_S_SHORT && packet->type != PACKET_TYPE_MODE_S_LONG) {
+		return;
+	}
+	const uint8_t *payload = packet->payload;
+	size_t len = packet_payload_len[packet->type];
+	uint32_t tail = (uint32_t) payload[len - 3] << 16 | (uint32_t) payload[len - 2] << 8 | payload[len - 1];
+	uint32_t syndrome = crc_mode_s(payload, len - 3) ^ tail;
+	uint8_t df = payload[0] >> 3;
+	switch (df) {
+		case 17:
+		case 18:
+			// DF18 with CF 0 is ADS-B from a 24-bit address; other CFs
+			// are anonymous or rebroadcast.
+			if (packet->type != PACKET_TYPE_MODE_S_LONG || syndrome || (df == 18 && (payload[0] & 0x07))) {
+				return;
+			}
+			aircraft_decode_es(aircraft_touch((uint32_t) payload[1] << 16 | (uint32_t) payload[2] << 8 | payload[3], now_ms), payload);
+			break;
+
+		case 5:
+		case 21: {
+			if (packet->type != (df == 5 ? PACKET_TYPE_MODE_S_SHORT : PACKET_TYPE_MODE_S_LONG)) {
+				return;
+			}
+			struct aircraft *aircraft = aircraft_find(syndrome | AIRCRAFT_USED);
+			if (!aircraft->key) {
+				return;
+			}
+			aircraft = aircraft_touch(syndrome, now_ms);
+			aircraft->squawk = aircraft_squawk((uint32_t) (payload[2] & 0x1f) << 8 | payload[3]);
+			aircraft->fields |= AIRCRAFT_SQUAWK;
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+const struct aircraft *aircraft_get(uint32_t icao) {
+	if (!aircraft_on) {
+		return NULL;
+	}
+	struct aircraft *aircraft = aircraft_find((icao & (AIRCRAFT_USED - 1)) | AIRCRAFT_USED);
+	return aircraft->key ? aircraft : NULL;
+}
+
+size_t aircraft_count() {
+	return aircraft_num;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct packet;
+
+#define AIRCRAFT_USED (1U << 24)
+
+enum aircraft_field {
+	AIRCRAFT_CALLSIGN = 1 << 0,
+	AIRCRAFT_ALTITUDE = 1 << 1,
+	AIRCRAFT_VELOCITY = 1 << 2,
+	AIRCRAFT_VERTICAL_RATE = 1 << 3,
+	AIRCRAFT_SQUAWK = 1 << 4,
+};
+
+// One cache line per aircraft. fields says which of the decoded values
+// have been heard.
+struct aircraft {
+	uint32_t key; // ICAO address | AIRCRAFT_USED; 0 if empty
+	uint32_t wheel_next;
+	uint64_t seen_ms;
+	uint64_t messages;
+	int32_t altitude_ft;
+	int16_t velocity_ew_kt; // east positive
+	int16_t velocity_ns_kt; // north positive
+	int16_t vertical_rate_fpm;
+	uint16_t squawk; // one octal digit per nibble, e.g. 0x7700
+	uint8_t category;
+	uint8_t fields;
+	char callsign[9];
+} __attribute__ ((aligned(64)));
+
+void aircraft_init(void);
+void aircraft_cleanup(void);
+bool __attribute__ ((warn_unused_result)) aircraft_enabled(void);
+void aircraft_update(const struct packet *, uint64_t);
+const struct aircraft * __attribute__ ((warn_unused_result)) aircraft_get(uint32_t);
+size_t __attribute__ ((warn_unused_result)) aircraft_count(void);
@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <ctype.h>
+#include <string.h>
 
 #include "buf.h"
 #include "hex.h"
@@ -33,9 +35,7 @@ static bool airspy_adsb_parse_packet(struct buf *buf, struct packet *packet, str
 
 	if (((buf->length < total_len - 1 || overlay->cr_lf != '\n') &&
 			 (buf->length < total_len || overlay->cr_lf != '\r' || overlay->lf != '\n')) ||
-			buf_chr(buf, 0) != '*' ||
-			overlay->semicolon1 != ';' ||
-	    overlay->semicolon2 != ';' ||
+			overlay->semicolon2 != ';' ||
 			overlay->semicolon3 != ';' ||
 			overlay->semicolon4 != ';') {
 		return false;
@@ -63,13 +63,37 @@ void airspy_adsb_init() {
 	assert(1 + PACKET_PAYLOAD_LEN_MAX + sizeof(struct airspy_adsb_overlay) < BUF_LEN_MAX);
 }
 
+uint8_t airspy_adsb_score(const struct buf *buf) {
+	if (buf_chr(buf, 0) != '*') {
+		return 0;
+	}
+	int term = buf_star_terminator(buf);
+	if (term < 0) {
+		return 10;
+	}
+	if (term == 0) {
+		return 50;
+	}
+	return isxdigit(term) ? 90 : 10;
+}
+
 bool airspy_adsb_parse(struct buf *buf, struct packet *packet, void *state_in) {
 	struct airspy_adsb_parser_state *state = (struct airspy_adsb_parser_state *) state_in;
 
-	return (
-			airspy_adsb_parse_packet(buf, packet, state, PACKET_TYPE_MODE_AC) ||
-			airspy_adsb_parse_packet(buf, packet, state, PACKET_TYPE_MODE_S_SHORT) ||
-			airspy_adsb_parse_packet(buf, packet, state, PACKET_TYPE_MODE_S_LONG));
+	// The first ';' ends the payload, and its position gives the type.
+	if (buf->length < 2 || buf_chr(buf, 0) != '*') {
+		return false;
+	}
+	size_t scan_len = buf->length - 1 < PACKET_PAYLOAD_LEN_MAX * 2 + 1 ? buf->length - 1 : PACKET_PAYLOAD_LEN_MAX * 2 + 1;
+	const uint8_t *semicolon = memchr(buf_at(buf, 1), ';', scan_len);
+	if (!semicolon) {
+		return false;
+	}
+	enum packet_type type = packet_type_from_text_len((size_t) (semicolon - buf_at(buf, 1)));
+	if (type == PACKET_TYPE_NONE) {
+		return false;
+	}
+	return airspy_adsb_parse_packet(buf, packet, state, type);
 }
 
 void airspy_adsb_serialize(struct packet *packet, struct buf *buf) {
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct buf;
 struct packet;
 
 void airspy_adsb_init(void);
+uint8_t __attribute__ ((warn_unused_result)) airspy_adsb_score(const struct buf *);
 bool __attribute__ ((warn_unused_result)) airspy_adsb_parse(struct buf *, struct packet *, void *);
 void airspy_adsb_serialize(struct packet *, struct buf *);
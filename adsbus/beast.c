@@ -58,38 +58,58 @@ static ssize_t beast_unescape(struct buf *out, const struct buf *in, size_t out_
 }
 
 static void beast_escape(struct buf *out, const struct buf *in) {
-	for (size_t i = 0; i < in->length; i++, out->length++) {
-		buf_chr(out, out->length) = buf_chr(in, i);
-		if (i > 0 && buf_chr(in, i) == 0x1a) {
-			buf_chr(out, ++(out->length)) = 0x1a;
+	// Block copy up to and including each 0x1a, then double it. The leading
+	// 0x1a is the frame start and isn't escaped.
+	size_t i = 0;
+	while (i < in->length) {
+		size_t from = i ? i : 1;
+		const uint8_t *escape = from < in->length ? memchr(buf_at(in, from), 0x1a, in->length - from) : NULL;
+		size_t end = escape ? (size_t) (escape - buf_at(in, 0)) + 1 : in->length;
+		memcpy(buf_at(out, out->length), buf_at(in, i), end - i);
+		out->length += end - i;
+		if (escape) {
+			buf_chr(out, out->length++) = 0x1a;
 		}
+		i = end;
 	}
 }
 
 static bool beast_parse_packet(struct buf *buf, struct packet *packet, struct beast_parser_state *state, enum packet_type type) {
-	struct buf buf2 = BUF_INIT;
+	uint8_t data2[BUF_LEN_MAX];
+	struct buf buf2 = BUF_INIT(data2);
 	size_t payload_bytes = packet_payload_len[type];
-	ssize_t in_bytes = beast_unescape(&buf2, buf, sizeof(struct beast_overlay) + payload_bytes);
-	if (in_bytes < 0) {
-		return false;
+	size_t frame_bytes = sizeof(struct beast_overlay) + payload_bytes;
+	struct beast_overlay *overlay;
+	ssize_t in_bytes;
+	if (buf->length >= frame_bytes && !memchr(buf_at(buf, 1), 0x1a, frame_bytes - 1)) {
+		// Most frames have nothing escaped; decode them in place.
+		overlay = (struct beast_overlay *) buf_at(buf, 0);
+		in_bytes = (ssize_t) frame_bytes;
+	} else {
+		in_bytes = beast_unescape(&buf2, buf, frame_bytes);
+		if (in_bytes < 0) {
+			return false;
+		}
+		overlay = (struct beast_overlay *) buf_at(&buf2, 0);
 	}
-	struct beast_overlay *overlay = (struct beast_overlay *) buf_at(&buf2, 0);
 	packet->type = type;
 	uint64_t source_mlat = beast_parse_mlat(overlay->mlat_timestamp);
 	packet->mlat_timestamp = packet_mlat_timestamp_scale_in(source_mlat, UINT64_C(0xffffffffffff), BEAST_MLAT_MHZ, &state->mlat_state);
 	packet->rssi = packet_rssi_scale_in(overlay->rssi, UINT8_MAX);
-	memcpy(packet->payload, buf_at(&buf2, sizeof(*overlay)), payload_bytes);
+	memcpy(packet->payload, (uint8_t *) overlay + sizeof(*overlay), payload_bytes);
 	buf_consume(buf, (size_t) in_bytes);
 	return true;
 }
 
 static void beast_serialize_packet(struct packet *packet, struct buf *buf, uint8_t beast_type) {
-	struct buf buf2 = BUF_INIT;
+	// Build the frame straight into the output, and only go through
+	// beast_escape() if it turns out to contain a 0x1a.
 	size_t payload_bytes = packet_payload_len[packet->type];
-	struct beast_overlay *overlay = (struct beast_overlay *) buf_at(&buf2, 0);
+	size_t frame_bytes = sizeof(struct beast_overlay) + payload_bytes;
+	struct beast_overlay *overlay = (struct beast_overlay *) buf_at(buf, buf->length);
 	overlay->one_a = 0x1a;
 	overlay->type = beast_type;
-	memcpy(buf_at(&buf2, sizeof(*overlay)), packet->payload, payload_bytes);
+	memcpy((uint8_t *) overlay + sizeof(*overlay), packet->payload, payload_bytes);
 	beast_write_mlat(
 			packet_mlat_timestamp_scale_out(packet->mlat_timestamp, UINT64_C(0xffffffffffff), BEAST_MLAT_MHZ),
 			overlay->mlat_timestamp);
@@ -100,7 +120,15 @@ static void beast_serialize_packet(struct packet *packet, struct buf *buf, uint8
 		overlay->rssi = UINT8_MAX;
 	}
 
-	buf2.length = sizeof(*overlay) + payload_bytes;
+	if (!memchr(&overlay->type, 0x1a, frame_bytes - 1)) {
+		buf->length += frame_bytes;
+		return;
+	}
+
+	uint8_t data2[BUF_LEN_MAX];
+	struct buf buf2 = BUF_INIT(data2);
+	memcpy(data2, overlay, frame_bytes);
+	buf2.length = frame_bytes;
 	beast_escape(buf, &buf2);
 }
 
@@ -109,6 +137,17 @@ void beast_init() {
 	assert((sizeof(struct beast_overlay) + PACKET_PAYLOAD_LEN_MAX) * 2 <= BUF_LEN_MAX);
 }
 
+uint8_t beast_score(const struct buf *buf) {
+	if (buf_chr(buf, 0) != 0x1a) {
+		return 0;
+	}
+	if (buf->length < 2) {
+		return 50;
+	}
+	uint8_t type = buf_chr(buf, 1);
+	return (type >= 0x31 && type <= 0x33) ? 90 : 0;
+}
+
 bool beast_parse(struct buf *buf, struct packet *packet, void *state_in) {
 	struct beast_parser_state *state = (struct beast_parser_state *) state_in;
 	struct beast_overlay *overlay = (struct beast_overlay *) buf_at(buf, 0);
@@ -134,6 +173,57 @@ bool beast_parse(struct buf *buf, struct packet *packet, void *state_in) {
 	return false;
 }
 
+// Bytes to skip to reach the next plausible frame start, or 0 if the head
+// might just be an incomplete frame.
+size_t beast_resync(const struct buf *buf) {
+	size_t frame_bytes = 0;
+	if (buf_chr(buf, 0) == 0x1a && buf->length >= 2) {
+		switch (buf_chr(buf, 1)) {
+			case 0x31:
+				frame_bytes = sizeof(struct beast_overlay) + packet_payload_len[PACKET_TYPE_MODE_AC];
+				break;
+
+			case 0x32:
+				frame_bytes = sizeof(struct beast_overlay) + packet_payload_len[PACKET_TYPE_MODE_S_SHORT];
+				break;
+
+			case 0x33:
+				frame_bytes = sizeof(struct beast_overlay) + packet_payload_len[PACKET_TYPE_MODE_S_LONG];
+				break;
+		}
+	}
+
+	if (frame_bytes) {
+		// Same walk as beast_unescape(); a lone 0x1a inside the frame is the
+		// start of the next one.
+		for (size_t i = 1, o = 1; o < frame_bytes; i++, o++) {
+			if (i >= buf->length) {
+				return 0;
+			}
+			if (buf_chr(buf, i) == 0x1a) {
+				if (i == buf->length - 1) {
+					return 0;
+				}
+				if (buf_chr(buf, i + 1) != 0x1a) {
+					return i;
+				}
+				i++;
+			}
+		}
+		return 0;
+	}
+
+	if (buf_chr(buf, 0) == 0x1a && buf->length < 2) {
+		return 0;
+	}
+	for (size_t i = 1; i < buf->length; i++) {
+		if (buf_chr(buf, i) == 0x1a) {
+			return i;
+		}
+	}
+	return buf->length;
+}
+
 void beast_serialize(struct packet *packet, struct buf *buf) {
 	switch (packet->type) {
 		case PACKET_TYPE_NONE:
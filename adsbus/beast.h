@@ -1,10 +1,14 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct buf;
 struct packet;
 
 void beast_init(void);
+uint8_t __attribute__ ((warn_unused_result)) beast_score(const struct buf *);
 bool __attribute__ ((warn_unused_result)) beast_parse(struct buf *, struct packet *, void *);
+size_t __attribute__ ((warn_unused_result)) beast_resync(const struct buf *);
 void beast_serialize(struct packet *, struct buf *);
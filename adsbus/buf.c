@@ -1,5 +1,8 @@
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "buf.h"
@@ -9,14 +12,57 @@ void buf_init(struct buf *buf) {
 	buf->length = 0;
 }
 
+static bool buf_alloc_ring(struct buf *buf) {
+	int fd = memfd_create("adsbus_buf", MFD_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	assert(!ftruncate(fd, (off_t) buf->size));
+	uint8_t *base = mmap(NULL, buf->size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(base != MAP_FAILED);
+	assert(mmap(base, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base);
+	assert(mmap(base + buf->size, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base + buf->size);
+	assert(!close(fd));
+	buf->buf = base;
+	buf->ring = true;
+	return true;
+}
+
+void buf_alloc(struct buf *buf, size_t size) {
+	// The ring has to be a whole number of pages
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	buf->size = (size + page_size - 1) / page_size * page_size;
+	buf_init(buf);
+	if (!buf_alloc_ring(buf)) {
+		// No memfd; fall back to moving data down when we hit the end
+		buf->buf = malloc(buf->size);
+		assert(buf->buf);
+		buf->ring = false;
+	}
+}
+
+void buf_free(struct buf *buf) {
+	if (buf->ring) {
+		assert(!munmap(buf->buf, buf->size * 2));
+	} else {
+		free(buf->buf);
+	}
+	buf->buf = NULL;
+}
+
 ssize_t buf_fill(struct buf *buf, int fd) {
-	if (buf->start + buf->length == BUF_LEN_MAX) {
-		assert(buf->start > 0);
-		memmove(buf->buf, buf_at(buf, 0), buf->length);
-		buf->start = 0;
+	size_t space;
+	if (buf->ring) {
+		space = buf->size - buf->length;
+	} else {
+		if (buf->start + buf->length == buf->size) {
+			assert(buf->start > 0);
+			memmove(buf->buf, buf_at(buf, 0), buf->length);
+			buf->start = 0;
+		}
+		space = buf->size - buf->length - buf->start;
 	}
 
-	size_t space = BUF_LEN_MAX - buf->length - buf->start;
 	ssize_t in = read(fd, buf_at(buf, buf->length), space);
 	if (in <= 0) {
 		return in;
@@ -31,7 +77,43 @@ void buf_consume(struct buf *buf, size_t length) {
 	buf->length -= length;
 	if (buf->length) {
 		buf->start += length;
+		if (buf->start >= buf->size) {
+			// Only possible for rings; the second mapping aliases the first
+			buf->start -= buf->size;
+		}
 	} else {
 		buf->start = 0;
 	}
 }
+
+// For the "*<hex>...;" line formats: skip to the next line start. 0 means
+// the head might just be an incomplete line.
+size_t buf_resync_star_line(const struct buf *buf) {
+	for (size_t i = 1; i < buf->length; i++) {
+		if (buf_chr(buf, i) == '*') {
+			return i;
+		}
+		if (buf_chr(buf, i) == '\n') {
+			return i + 1;
+		}
+	}
+	return buf_chr(buf, 0) == '*' ? 0 : buf->length;
+}
+
+// Returns the byte after "*<hex>;", or 0 if the buffer ends first, or -1
+// if it doesn't look like a line of either text format.
+int buf_star_terminator(const struct buf *buf) {
+	size_t i = 1;
+	for (; i < buf->length && isxdigit(buf_chr(buf, i)); i++) {
+	}
+	if (i >= buf->length) {
+		return 0;
+	}
+	if (buf_chr(buf, i) != ';' || i == 1) {
+		return -1;
+	}
+	if (++i >= buf->length) {
+		return 0;
+	}
+	return buf_chr(buf, i);
+}
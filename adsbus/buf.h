@@ -1,23 +1,36 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
+// Small scratch/serialization buffers are BUF_LEN_MAX bytes of caller
+// storage. Receive buffers are larger rings from buf_alloc(), mapped twice
+// back to back so that [start, start + length) is always contiguous.
 #define BUF_LEN_MAX 256
 struct buf {
-	uint8_t buf[BUF_LEN_MAX];
+	uint8_t *buf;
+	size_t size;
 	size_t start;
 	size_t length;
+	bool ring;
 };
-#define BUF_INIT { \
+#define BUF_INIT(storage) { \
+	.buf = (storage), \
+	.size = sizeof(storage), \
 	.start = 0, \
 	.length = 0, \
+	.ring = false, \
 }
 
 #define buf_chr(buff, at) ((buff)->buf[(buff)->start + (at)])
 #define buf_at(buff, at) (&buf_chr(buff, at))
 
 void buf_init(struct buf *);
+void buf_alloc(struct buf *, size_t);
+void buf_free(struct buf *);
 ssize_t buf_fill(struct buf *, int);
 void buf_consume(struct buf *, size_t);
+int __attribute__ ((warn_unused_result)) buf_star_terminator(const struct buf *);
+size_t __attribute__ ((warn_unused_result)) buf_resync_star_line(const struct buf *);
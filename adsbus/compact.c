@@ -0,0 +1,425 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "buf.h"
+#include "log.h"
+#include "packet.h"
+#include "receive.h"
+#include "server.h"
+#include "source.h"
+#include "uuid.h"
+
+#include "compact.h"
+
+// Federation format: one dictionary record per source, after which packets
+// carry a small index instead of the source ID, plus the MLAT timestamp as a
+// delta from that source's previous one. See protocols/compact.md.
+
+#define COMPACT_MAGIC "aDsB"
+#define COMPACT_MAGIC_LEN 4
+
+#define COMPACT_HEADER 0x01
+#define COMPACT_DEFINE 0x02
+#define COMPACT_PACKET 0x10
+#define COMPACT_PACKET_TYPE 0x03
+#define COMPACT_PACKET_MLAT 0x04
+#define COMPACT_PACKET_RSSI 0x08
+
+// Indexes are dense, so this also bounds the receive dictionary.
+#define COMPACT_SOURCES_MAX 4096
+#define COMPACT_SOURCES_SLOTS (COMPACT_SOURCES_MAX * 2)
+
+struct compact_source {
+	struct source_cache source;
+	uint64_t mlat_timestamp;
+	struct packet_mlat_state mlat_state;
+	bool defined;
+};
+
+struct compact_parser_state {
+	struct compact_source *sources;
+	uint32_t num_sources;
+	uint16_t mlat_timestamp_mhz;
+	uint64_t mlat_timestamp_max;
+	uint32_t rssi_max;
+	bool have_header;
+};
+
+// Sender dictionary, shared by every compact client since they all get the
+// same serialized stream. Keyed by input as well as source ID so that clients
+// skipping packets from their own socket never see an index whose definition
+// they skipped.
+struct compact_send_source {
+	uint32_t source;
+	dev_t dev;
+	ino_t ino;
+	uint32_t index;
+	uint64_t generation;
+	uint64_t mlat_timestamp;
+	bool used;
+};
+
+static char log_module = 'R'; // borrowing
+
+static struct compact_send_source compact_send_sources[COMPACT_SOURCES_SLOTS];
+static uint32_t compact_num_send_sources = 0;
+// Consecutive packets usually share a source; skip the hash for them.
+static struct compact_send_source *compact_send_last = NULL;
+static uint64_t compact_generation = 1;
+static uint8_t compact_hello_data[BUF_LEN_MAX];
+static struct buf compact_hello_buf = BUF_INIT(compact_hello_data);
+
+static void compact_write_varint(struct buf *buf, uint64_t value) {
+	for (; value >= 0x80; value >>= 7) {
+		buf_chr(buf, buf->length++) = (uint8_t) (value | 0x80);
+	}
+	buf_chr(buf, buf->length++) = (uint8_t) value;
+}
+
+static void compact_write_string(struct buf *buf, const char *str) {
+	size_t len = strlen(str);
+	assert(len <= UINT8_MAX);
+	buf_chr(buf, buf->length++) = (uint8_t) len;
+	memcpy(buf_at(buf, buf->length), str, len);
+	buf->length += len;
+}
+
+static const uint8_t *compact_read_varint(const uint8_t *ptr, const uint8_t *end, uint64_t *value) {
+	*value = 0;
+	for (size_t i = 0; i < 10 && ptr < end; i++, ptr++) {
+		*value |= ((uint64_t) *ptr & 0x7f) << (7 * i);
+		if (!(*ptr & 0x80)) {
+			return ptr + 1;
+		}
+	}
+	return NULL;
+}
+
+static const uint8_t *compact_read_id(const uint8_t *ptr, const uint8_t *end, uint8_t *id) {
+	if (ptr >= end || *ptr >= UUID_LEN || end - ptr - 1 < *ptr) {
+		return NULL;
+	}
+	uint8_t len = *(ptr++);
+	memcpy(id, ptr, len);
+	id[len] = '\0';
+	if (!packet_validate_id(id)) {
+		return NULL;
+	}
+	return ptr + len;
+}
+
+static uint32_t compact_hash(const struct packet *packet) {
+	// FNV-1a, by word
+	uint32_t hash = 2166136261U;
+	hash = (hash ^ packet->source) * 16777619U;
+	hash = (hash ^ (uint32_t) packet->input_stat->st_ino) * 16777619U;
+	hash = (hash ^ (uint32_t) packet->input_stat->st_dev) * 16777619U;
+	return hash;
+}
+
+static bool compact_send_source_match(const struct compact_send_source *source, const struct packet *packet) {
+	return (
+			source->source == packet->source &&
+			source->ino == packet->input_stat->st_ino &&
+			source->dev == packet->input_stat->st_dev);
+}
+
+static struct compact_send_source *compact_send_source_find(const struct packet *packet) {
+	uint32_t hash = compact_hash(packet);
+	struct compact_send_source *source;
+	for (uint32_t i = hash;; i++) {
+		source = &compact_send_sources[i % COMPACT_SOURCES_SLOTS];
+		if (!source->used) {
+			break;
+		}
+		if (compact_send_source_match(source, packet)) {
+			return source;
+		}
+	}
+
+	if (compact_num_send_sources == COMPACT_SOURCES_MAX) {
+		// Start over; indexes are redefined before reuse.
+		for (uint32_t i = 0; i < COMPACT_SOURCES_SLOTS; i++) {
+			if (compact_send_sources[i].used) {
+				source_unref(compact_send_sources[i].source);
+			}
+		}
+		memset(compact_send_sources, 0, sizeof(compact_send_sources));
+		compact_num_send_sources = 0;
+		source = &compact_send_sources[hash % COMPACT_SOURCES_SLOTS];
+	}
+
+	// Held until the table starts over, so the handle keeps naming this ID
+	source->source = packet->source;
+	source_ref(source->source);
+	source->dev = packet->input_stat->st_dev;
+	source->ino = packet->input_stat->st_ino;
+	source->index = compact_num_send_sources++;
+	source->generation = 0;
+	source->used = true;
+	return source;
+}
+
+static struct compact_send_source *compact_send_source_get(const struct packet *packet) {
+	if (!compact_send_last || !compact_send_source_match(compact_send_last, packet)) {
+		compact_send_last = compact_send_source_find(packet);
+	}
+	return compact_send_last;
+}
+
+static const uint8_t *compact_parse_header(const uint8_t *ptr, const uint8_t *end, struct packet *packet, struct compact_parser_state *state) {
+	if (end - ptr < COMPACT_MAGIC_LEN || memcmp(ptr, COMPACT_MAGIC, COMPACT_MAGIC_LEN)) {
+		return NULL;
+	}
+	ptr += COMPACT_MAGIC_LEN;
+
+	// server_version
+	if (ptr >= end || end - ptr - 1 < *ptr) {
+		return NULL;
+	}
+	ptr += 1 + *ptr;
+
+	uint8_t remote_id[UUID_LEN];
+	uint64_t mlat_timestamp_mhz, mlat_timestamp_max, rssi_max;
+	if (!(ptr = compact_read_id(ptr, end, remote_id)) ||
+			!(ptr = compact_read_varint(ptr, end, &mlat_timestamp_mhz)) ||
+			!(ptr = compact_read_varint(ptr, end, &mlat_timestamp_max)) ||
+			!(ptr = compact_read_varint(ptr, end, &rssi_max))) {
+		return NULL;
+	}
+
+	if (!mlat_timestamp_mhz ||
+			mlat_timestamp_mhz > UINT16_MAX ||
+			!mlat_timestamp_max ||
+			!rssi_max ||
+			rssi_max > UINT16_MAX) {
+		return NULL;
+	}
+
+	if (!strcmp((const char *) remote_id, (const char *) server_id)) {
+		LOG(source_get(packet->source), "Attempt to receive compact data from our own server ID (%s); loop!", server_id);
+		return NULL;
+	}
+
+	state->mlat_timestamp_mhz = (uint16_t) mlat_timestamp_mhz;
+	state->mlat_timestamp_max = mlat_timestamp_max;
+	state->rssi_max = (uint32_t) rssi_max;
+	for (uint32_t i = 0; i < state->num_sources; i++) {
+		state->sources[i].defined = false;
+	}
+	state->have_header = true;
+	LOG(source_get(packet->source), "Connected to server ID: %s", remote_id);
+	return ptr;
+}
+
+static const uint8_t *compact_parse_define(const uint8_t *ptr, const uint8_t *end, struct compact_parser_state *state) {
+	if (!state->have_header) {
+		return NULL;
+	}
+
+	uint64_t index;
+	uint8_t id[UUID_LEN];
+	if (!(ptr = compact_read_varint(ptr, end, &index)) ||
+			index >= COMPACT_SOURCES_MAX ||
+			!(ptr = compact_read_id(ptr, end, id))) {
+		return NULL;
+	}
+
+	if (index >= state->num_sources) {
+		uint32_t num_sources = state->num_sources * 2;
+		if (num_sources <= index) {
+			num_sources = (uint32_t) index + 1;
+		}
+		if (num_sources > COMPACT_SOURCES_MAX) {
+			num_sources = COMPACT_SOURCES_MAX;
+		}
+		state->sources = realloc(state->sources, num_sources * sizeof(*state->sources));
+		assert(state->sources);
+		memset(&state->sources[state->num_sources], 0, (num_sources - state->num_sources) * sizeof(*state->sources));
+		state->num_sources = num_sources;
+	}
+
+	struct compact_source *source = &state->sources[index];
+	if (!source_cache_hit(&source->source, source_intern(id))) {
+		memset(&source->mlat_state, 0, sizeof(source->mlat_state));
+	}
+	source->mlat_timestamp = 0;
+	source->defined = true;
+	return ptr;
+}
+
+static const uint8_t *compact_parse_packet(uint8_t opcode, const uint8_t *ptr, const uint8_t *end, struct packet *packet, struct compact_parser_state *state) {
+	if (!state->have_header) {
+		return NULL;
+	}
+
+	enum packet_type type = (enum packet_type) ((opcode & COMPACT_PACKET_TYPE) + 1);
+	if (type >= NUM_TYPES) {
+		return NULL;
+	}
+
+	uint64_t index, hops;
+	if (!(ptr = compact_read_varint(ptr, end, &index)) ||
+			index >= state->num_sources ||
+			!state->sources[index].defined ||
+			!(ptr = compact_read_varint(ptr, end, &hops)) ||
+			hops > UINT32_MAX) {
+		return NULL;
+	}
+	struct compact_source *source = &state->sources[index];
+
+	uint64_t mlat_timestamp = source->mlat_timestamp;
+	if (opcode & COMPACT_PACKET_MLAT) {
+		uint64_t zigzag;
+		if (!(ptr = compact_read_varint(ptr, end, &zigzag))) {
+			return NULL;
+		}
+		mlat_timestamp += (zigzag >> 1) ^ -(zigzag & 1);
+	}
+
+	uint32_t rssi = 0;
+	if (opcode & COMPACT_PACKET_RSSI) {
+		if (end - ptr < 2) {
+			return NULL;
+		}
+		rssi = (uint32_t) (ptr[0] << 8 | ptr[1]);
+		if (rssi > state->rssi_max) {
+			return NULL;
+		}
+		ptr += 2;
+	}
+
+	size_t payload_len = packet_payload_len[type];
+	if ((size_t) (end - ptr) < payload_len) {
+		return NULL;
+	}
+	memcpy(packet->payload, ptr, payload_len);
+	ptr += payload_len;
+
+	packet->type = type;
+	packet->source = source->source.source;
+	packet->hops = (uint32_t) hops;
+	if (opcode & COMPACT_PACKET_MLAT) {
+		source->mlat_timestamp = mlat_timestamp;
+		packet->mlat_timestamp = packet_mlat_timestamp_scale_in(
+				mlat_timestamp,
+				state->mlat_timestamp_max,
+				state->mlat_timestamp_mhz,
+				&source->mlat_state);
+	}
+	if (rssi) {
+		packet->rssi = packet_rssi_scale_in(rssi, state->rssi_max);
+	}
+	return ptr;
+}
+
+void compact_init() {
+	assert(sizeof(struct compact_parser_state) <= PARSER_STATE_LEN);
+
+	buf_chr(&compact_hello_buf, compact_hello_buf.length++) = COMPACT_HEADER;
+	memcpy(buf_at(&compact_hello_buf, compact_hello_buf.length), COMPACT_MAGIC, COMPACT_MAGIC_LEN);
+	compact_hello_buf.length += COMPACT_MAGIC_LEN;
+	compact_write_string(&compact_hello_buf, server_version);
+	compact_write_string(&compact_hello_buf, (const char *) server_id);
+	compact_write_varint(&compact_hello_buf, PACKET_MLAT_MHZ);
+	compact_write_varint(&compact_hello_buf, PACKET_MLAT_MAX);
+	compact_write_varint(&compact_hello_buf, UINT16_MAX);
+	assert(compact_hello_buf.length <= BUF_LEN_MAX);
+}
+
+uint8_t compact_score(const struct buf *buf) {
+	// Header record: 0x01, then the "aDsB" magic
+	static const char magic[] = "\x01" "aDsB";
+	size_t len = buf->length < sizeof(magic) - 1 ? buf->length : sizeof(magic) - 1;
+	if (memcmp(buf_at(buf, 0), magic, len)) {
+		return 0;
+	}
+	return len == sizeof(magic) - 1 ? 90 : 50;
+}
+
+bool compact_parse(struct buf *buf, struct packet *packet, void *state_in) {
+	struct compact_parser_state *state = (struct compact_parser_state *) state_in;
+
+	if (!buf->length) {
+		return false;
+	}
+	const uint8_t *start = buf_at(buf, 0);
+	const uint8_t *end = start + buf->length;
+	uint8_t opcode = *start;
+
+	const uint8_t *ptr;
+	if (opcode == COMPACT_HEADER) {
+		ptr = compact_parse_header(start + 1, end, packet, state);
+		packet->type = PACKET_TYPE_NONE;
+	} else if (opcode == COMPACT_DEFINE) {
+		ptr = compact_parse_define(start + 1, end, state);
+		packet->type = PACKET_TYPE_NONE;
+	} else if ((opcode & ~(COMPACT_PACKET_TYPE | COMPACT_PACKET_MLAT | COMPACT_PACKET_RSSI)) == COMPACT_PACKET) {
+		ptr = compact_parse_packet(opcode, start + 1, end, packet, state);
+	} else {
+		return false;
+	}
+	if (!ptr) {
+		return false;
+	}
+
+	buf_consume(buf, (size_t) (ptr - start));
+	return true;
+}
+
+void compact_parser_cleanup(void *state_in) {
+	struct compact_parser_state *state = (struct compact_parser_state *) state_in;
+	for (uint32_t i = 0; i < state->num_sources; i++) {
+		source_cache_clear(&state->sources[i].source);
+	}
+	free(state->sources);
+}
+
+void compact_serialize(struct packet *packet, struct buf *buf) {
+	if (packet->type == PACKET_TYPE_NONE) {
+		return;
+	}
+
+	struct compact_send_source *source = compact_send_source_get(packet);
+	if (source->generation != compact_generation) {
+		buf_chr(buf, buf->length++) = COMPACT_DEFINE;
+		compact_write_varint(buf, source->index);
+		compact_write_string(buf, (const char *) source_get(source->source));
+		source->generation = compact_generation;
+		source->mlat_timestamp = 0;
+	}
+
+	uint8_t *opcode = buf_at(buf, buf->length++);
+	*opcode = (uint8_t) (COMPACT_PACKET | (packet->type - 1));
+	compact_write_varint(buf, source->index);
+	compact_write_varint(buf, packet->hops);
+	if (packet->mlat_timestamp) {
+		*opcode |= COMPACT_PACKET_MLAT;
+		// Both are at most PACKET_MLAT_MAX, so the difference fits.
+		int64_t delta = (int64_t) (packet->mlat_timestamp - source->mlat_timestamp);
+		compact_write_varint(buf, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+		source->mlat_timestamp = packet->mlat_timestamp;
+	}
+	if (packet->rssi) {
+		*opcode |= COMPACT_PACKET_RSSI;
+		uint32_t rssi = packet_rssi_scale_out(packet->rssi, UINT16_MAX);
+		buf_chr(buf, buf->length++) = (uint8_t) (rssi >> 8);
+		buf_chr(buf, buf->length++) = (uint8_t) rssi;
+	}
+	size_t payload_len = packet_payload_len[packet->type];
+	memcpy(buf_at(buf, buf->length), packet->payload, payload_len);
+	buf->length += payload_len;
+}
+
+void compact_hello(struct buf **buf) {
+	*buf = &compact_hello_buf;
+}
+
+void compact_restart() {
+	// A new client knows none of the indexes; define each source again before
+	// its next packet. Existing clients just see redundant definitions.
+	compact_generation++;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct buf;
+struct packet;
+
+void compact_init(void);
+uint8_t __attribute__ ((warn_unused_result)) compact_score(const struct buf *);
+bool __attribute__ ((warn_unused_result)) compact_parse(struct buf *, struct packet *, void *);
+void compact_parser_cleanup(void *);
+void compact_serialize(struct packet *, struct buf *);
+void compact_hello(struct buf **);
+void compact_restart(void);
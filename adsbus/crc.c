@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icao_table.h"
+#include "packet.h"
+
+#include "crc.h"
+
+// Mode-S parity checking, between receive and send. ADSBUS_CRC selects:
+//   off:     forward everything (default)
+//   count:   count good/bad frames, forward everything
+//   drop:    drop frames with bad parity
+//   correct: drop, but first repair single-bit errors in DF17/18
+
+#define CRC_POLY 0xfff409
+// Addresses from valid DF11/17/18 frames vouch for address/parity frames
+// for this long.
+#define CRC_ICAO_TTL_MS 60000
+// Single-bit syndromes for 112-bit frames, open-addressed by syndrome.
+#define CRC_SYNDROME_SLOTS 256
+
+static enum crc_mode {
+	CRC_MODE_OFF,
+	CRC_MODE_COUNT,
+	CRC_MODE_DROP,
+	CRC_MODE_CORRECT,
+} crc_mode = CRC_MODE_OFF;
+
+static struct {
+	char *name;
+	enum crc_mode mode;
+} crc_modes[] = {
+	{ "off", CRC_MODE_OFF },
+	{ "count", CRC_MODE_COUNT },
+	{ "drop", CRC_MODE_DROP },
+	{ "correct", CRC_MODE_CORRECT },
+};
+#define NUM_CRC_MODES (sizeof(crc_modes) / sizeof(*crc_modes))
+
+struct crc_syndrome {
+	uint32_t syndrome;
+	uint8_t bit;
+};
+
+char *crc_result_names[] = {
+	"unchecked",
+	"good",
+	"corrected",
+	"bad",
+};
+
+uint64_t crc_totals[NUM_CRC_RESULTS];
+
+static uint32_t crc_table[256];
+static struct crc_syndrome crc_syndromes[CRC_SYNDROME_SLOTS];
+static struct icao_table *crc_icao_table = NULL;
+
+static uint32_t crc_syndrome(const uint8_t *payload, size_t len) {
+	uint32_t tail = (uint32_t) payload[len - 3] << 16 | (uint32_t) payload[len - 2] << 8 | payload[len - 1];
+	return crc_mode_s(payload, len - 3) ^ tail;
+}
+
+static struct crc_syndrome *crc_syndrome_find(uint32_t syndrome) {
+	for (uint32_t i = (syndrome * 0x9e3779b1U) >> 24;; i = (i + 1) % CRC_SYNDROME_SLOTS) {
+		struct crc_syndrome *entry = &crc_syndromes[i];
+		if (!entry->syndrome || entry->syndrome == syndrome) {
+			return entry;
+		}
+	}
+}
+
+static void crc_syndromes_init() {
+	// Error in bit N of a frame always leaves the same syndrome, whatever the
+	// rest of the frame says. Skip the DF field; a flip there means the frame
+	// wasn't DF17/18 in the first place.
+	size_t len = packet_payload_len[PACKET_TYPE_MODE_S_LONG];
+	for (uint8_t bit = 5; bit < len * 8; bit++) {
+		uint8_t payload[PACKET_PAYLOAD_LEN_MAX] = { 0 };
+		payload[bit / 8] = (uint8_t) (0x80 >> (bit % 8));
+		uint32_t syndrome = crc_syndrome(payload, len);
+		struct crc_syndrome *entry = crc_syndrome_find(syndrome);
+		assert(!entry->syndrome);
+		entry->syndrome = syndrome;
+		entry->bit = bit;
+	}
+}
+
+static enum crc_result crc_check_clear(struct packet *packet, uint8_t df, uint64_t now_ms) {
+	// Address in the clear, followed by parity
+	size_t len = packet_payload_len[packet->type];
+	uint32_t syndrome = crc_syndrome(packet->payload, len);
+	enum crc_result result = CRC_GOOD;
+	if (df == 11) {
+		// Low 7 bits are the interrogator code
+		if (syndrome & ~0x7fU) {
+			return CRC_BAD;
+		}
+	} else if (syndrome) {
+		if (crc_mode != CRC_MODE_CORRECT) {
+			return CRC_BAD;
+		}
+		struct crc_syndrome *entry = crc_syndrome_find(syndrome);
+		if (!entry->syndrome) {
+			return CRC_BAD;
+		}
+		packet->payload[entry->bit / 8] ^= (uint8_t) (0x80 >> (entry->bit % 8));
+		result = CRC_CORRECTED;
+	}
+	icao_table_touch(crc_icao_table, (uint32_t) packet->payload[1] << 16 | (uint32_t) packet->payload[2] << 8 | packet->payload[3], now_ms);
+	return result;
+}
+
+static enum crc_result crc_check(struct packet *packet, uint64_t now_ms) {
+	if (packet->type != PACKET_TYPE_MODE_S_SHORT && packet->type != PACKET_TYPE_MODE_S_LONG) {
+		return CRC_UNCHECKED;
+	}
+	uint8_t df = packet->payload[0] >> 3;
+	switch (df) {
+		case 11:
+			if (packet->type != PACKET_TYPE_MODE_S_SHORT) {
+				return CRC_BAD;
+			}
+			return crc_check_clear(packet, df, now_ms);
+
+		case 17:
+		case 18:
+			if (packet->type != PACKET_TYPE_MODE_S_LONG) {
+				return CRC_BAD;
+			}
+			return crc_check_clear(packet, df, now_ms);
+
+		case 0:
+		case 4:
+		case 5:
+		case 16:
+		case 20:
+		case 21:
+			// Address/parity: only as good as our having heard the address
+			// recently in the clear.
+			if (packet->type != (df < 16 ? PACKET_TYPE_MODE_S_SHORT : PACKET_TYPE_MODE_S_LONG)) {
+				return CRC_BAD;
+			}
+			if (!icao_table_seen(crc_icao_table, crc_syndrome(packet->payload, packet_payload_len[packet->type]), now_ms)) {
+				return CRC_BAD;
+			}
+			return CRC_GOOD;
+
+		default:
+			return CRC_UNCHECKED;
+	}
+}
+
+void crc_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i << 16;
+		for (int j = 0; j < 8; j++) {
+			crc <<= 1;
+			if (crc & 0x1000000) {
+				crc ^= CRC_POLY;
+			}
+		}
+		crc_table[i] = crc & 0xffffff;
+	}
+	crc_syndromes_init();
+
+	char *mode = getenv("ADSBUS_CRC");
+	if (mode) {
+		size_t i;
+		for (i = 0; i < NUM_CRC_MODES; i++) {
+			if (!strcmp(mode, crc_modes[i].name)) {
+				crc_mode = crc_modes[i].mode;
+				break;
+			}
+		}
+		assert(i < NUM_CRC_MODES);
+	}
+	if (crc_mode != CRC_MODE_OFF) {
+		crc_icao_table = icao_table_new(CRC_ICAO_TTL_MS);
+	}
+}
+
+void crc_cleanup() {
+	if (crc_icao_table) {
+		icao_table_del(crc_icao_table);
+	}
+}
+
+bool crc_enabled() {
+	return crc_mode != CRC_MODE_OFF;
+}
+
+uint32_t crc_mode_s(const uint8_t *data, size_t len) {
+	uint32_t crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc = ((crc << 8) ^ crc_table[((crc >> 16) ^ data[i]) & 0xff]) & 0xffffff;
+	}
+	return crc;
+}
+
+bool crc_filter(struct packet *packet, uint64_t now_ms, uint64_t *counts) {
+	// Returns false if packet should be dropped. counts is per input.
+	enum crc_result result = crc_check(packet, now_ms);
+	counts[result]++;
+	crc_totals[result]++;
+	return result != CRC_BAD || crc_mode == CRC_MODE_COUNT;
+}
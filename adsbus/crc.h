@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct packet;
+
+enum crc_result {
+	CRC_UNCHECKED,
+	CRC_GOOD,
+	CRC_CORRECTED,
+	CRC_BAD,
+	NUM_CRC_RESULTS,
+};
+
+extern char *crc_result_names[];
+extern uint64_t crc_totals[];
+
+void crc_init(void);
+void crc_cleanup(void);
+bool __attribute__ ((warn_unused_result)) crc_enabled(void);
+uint32_t __attribute__ ((warn_unused_result)) crc_mode_s(const uint8_t *, size_t);
+bool __attribute__ ((warn_unused_result)) crc_filter(struct packet *, uint64_t, uint64_t *);
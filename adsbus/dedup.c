@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "packet.h"
+#include "source.h"
+
+#include "dedup.h"
+
+// Cross-source duplicate detection. Receivers that hear the same
+// transmission each hand us the same payload within a few milliseconds; the
+// first copy wins and the others are marked duplicate for outputs with
+// dedup=on. A repeat from the same source is a new transmission (and
+// restarts the window).
+
+#define DEDUP_SLOTS (1 << 14)
+#define DEDUP_PROBE_MAX 8
+
+struct dedup_entry {
+	uint64_t hash;
+	uint32_t time_ms;
+	uint32_t source;
+};
+
+uint64_t dedup_unique_count = 0;
+uint64_t dedup_duplicate_count = 0;
+
+// Fixed size; entries expire rather than get deleted. Each occupied slot
+// holds a reference to its source, so the handle can't be collected and
+// reused by another source while the slot can still match.
+static struct dedup_entry dedup_table[DEDUP_SLOTS];
+static uint32_t dedup_window_ms = 200;
+static bool dedup_on = false;
+
+static uint64_t dedup_hash(const struct packet *packet) {
+	// FNV-1a; 0 marks an empty slot
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ packet->type) * 1099511628211ULL;
+	size_t len = packet_payload_len[packet->type];
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ packet->payload[i]) * 1099511628211ULL;
+	}
+	return hash | 1;
+}
+
+void dedup_init() {
+	char *window_ms = getenv("ADSBUS_DEDUP_WINDOW_MS");
+	if (window_ms) {
+		char *end_ptr;
+		unsigned long window_ms_ul = strtoul(window_ms, &end_ptr, 10);
+		assert(window_ms[0] != '\0');
+		assert(end_ptr[0] == '\0');
+		assert(window_ms_ul > 0 && window_ms_ul <= INT32_MAX);
+		dedup_window_ms = (uint32_t) window_ms_ul;
+	}
+}
+
+void dedup_enable() {
+	dedup_on = true;
+}
+
+bool dedup_enabled() {
+	return dedup_on;
+}
+
+bool dedup_check(const struct packet *packet, uint64_t now_ms_64) {
+	// Returns true if packet is a copy of one recently seen from another
+	// source. Mode-AC replies are too short to tell aircraft apart.
+	if (packet->type == PACKET_TYPE_MODE_AC) {
+		return false;
+	}
+	uint32_t now_ms = (uint32_t) now_ms_64;
+	uint64_t hash = dedup_hash(packet);
+	struct dedup_entry *victim = NULL;
+	bool victim_live = true;
+	for (uint32_t i = 0; i < DEDUP_PROBE_MAX; i++) {
+		struct dedup_entry *entry = &dedup_table[((uint32_t) (hash >> 32) + i) % DEDUP_SLOTS];
+		bool live = entry->hash && now_ms - entry->time_ms < dedup_window_ms;
+		if (live && entry->hash == hash) {
+			if (entry->source != packet->source) {
+				dedup_duplicate_count++;
+				return true;
+			}
+			entry->time_ms = now_ms;
+			dedup_unique_count++;
+			return false;
+		}
+		// Reuse the first dead slot, or failing that the oldest live one
+		if (!live) {
+			if (victim_live) {
+				victim = entry;
+				victim_live = false;
+			}
+		} else if (victim_live && (!victim || now_ms - entry->time_ms > now_ms - victim->time_ms)) {
+			victim = entry;
+		}
+	}
+	source_ref(packet->source);
+	if (victim->hash) {
+		source_unref(victim->source);
+	}
+	victim->hash = hash;
+	victim->time_ms = now_ms;
+	victim->source = packet->source;
+	dedup_unique_count++;
+	return false;
+}
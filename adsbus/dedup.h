@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct packet;
+
+extern uint64_t dedup_unique_count;
+extern uint64_t dedup_duplicate_count;
+
+void dedup_init(void);
+void dedup_enable(void);
+bool __attribute__ ((warn_unused_result)) dedup_enabled(void);
+bool __attribute__ ((warn_unused_result)) dedup_check(const struct packet *, uint64_t);
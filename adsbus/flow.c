@@ -7,7 +7,8 @@
 #include "flow.h"
 
 static bool flow_send_hello(int fd, struct flow *flow, void *passthrough) {
-	struct buf buf = BUF_INIT, *buf_ptr = &buf;
+	uint8_t data[BUF_LEN_MAX];
+	struct buf buf = BUF_INIT(data), *buf_ptr = &buf;
 	flow_get_hello(flow, &buf_ptr, passthrough);
 	if (!buf_ptr->length) {
 		return true;
@@ -1,7 +1,15 @@
 #include <assert.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "hex.h"
 
 static uint8_t hex_table[256];
@@ -10,7 +18,198 @@ static uint8_t hex_lower_table[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '
 
 #define HEX_INVALID 0xff
 
+static bool hex_ssse3 = false;
+
+#ifdef __x86_64__
+
+// 16 hex characters <-> 8 bytes per vector. Inputs of 8 bytes or more are
+// covered by a first and a last (possibly overlapping) vector, so nothing
+// is read or written outside the caller's range. Shorter ones stay scalar.
+
+static bool __attribute__ ((target("ssse3"))) hex_to_bin_ssse3_8(uint8_t *out, const uint8_t *in) {
+	__m128i chars = _mm_loadu_si128((const __m128i *) in);
+	__m128i digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+	__m128i alpha = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) {
+		return false;
+	}
+	__m128i nibbles = _mm_or_si128(
+			_mm_and_si128(is_digit, digit),
+			_mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+	// (high nibble * 16) + (low nibble * 1) for each byte pair
+	__m128i bytes = _mm_maddubs_epi16(nibbles, _mm_set1_epi16(0x0110));
+	_mm_storel_epi64((__m128i *) out, _mm_packus_epi16(bytes, bytes));
+	return true;
+}
+
+static bool __attribute__ ((target("ssse3"))) hex_to_bin_ssse3(uint8_t *out, const uint8_t *in, size_t bytes) {
+	for (size_t i = 0; i + 8 < bytes; i += 8) {
+		if (!hex_to_bin_ssse3_8(&out[i], &in[i * 2])) {
+			return false;
+		}
+	}
+	return hex_to_bin_ssse3_8(&out[bytes - 8], &in[(bytes - 8) * 2]);
+}
+
+static void __attribute__ ((target("ssse3"))) hex_from_bin_ssse3_8(uint8_t *out, const uint8_t *in, __m128i table) {
+	__m128i bytes = _mm_loadl_epi64((const __m128i *) in);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+	__m128i low = _mm_and_si128(bytes, mask);
+	_mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(table, _mm_unpacklo_epi8(high, low)));
+}
+
+static void __attribute__ ((target("ssse3"))) hex_from_bin_ssse3(uint8_t *out, const uint8_t *in, size_t bytes, const uint8_t table[]) {
+	__m128i table_vec = _mm_loadu_si128((const __m128i *) table);
+	for (size_t i = 0; i + 8 < bytes; i += 8) {
+		hex_from_bin_ssse3_8(&out[i * 2], &in[i], table_vec);
+	}
+	hex_from_bin_ssse3_8(&out[(bytes - 8) * 2], &in[bytes - 8], table_vec);
+}
+
+#endif
+
+static bool hex_to_bin_scalar(uint8_t *out, const uint8_t *in, size_t bytes) {
+	for (size_t i = 0, j = 0; i < bytes; i++, j += 2) {
+		uint8_t val1 = hex_table[in[j]], val2 = hex_table[in[j + 1]];
+		if (val1 == HEX_INVALID || val2 == HEX_INVALID) {
+			return false;
+		}
+		out[i] = (uint8_t) (val1 << 4) | val2;
+	}
+	return true;
+}
+
+static void hex_from_bin_scalar(uint8_t *out, const uint8_t *in, size_t bytes, const uint8_t table[]) {
+	for (size_t i = 0, j = 0; i < bytes; i++, j += 2) {
+		out[j] = table[in[i] >> 4];
+		out[j + 1] = table[in[i] & 0xf];
+	}
+}
+
+#ifdef __x86_64__
+
+#define HEX_CHECK_MAX 40
+
+static void hex_check_from_bin(const uint8_t table[]) {
+	uint8_t in[HEX_CHECK_MAX], out[HEX_CHECK_MAX * 2 + 1], expected[HEX_CHECK_MAX * 2];
+	for (size_t bytes = 8; bytes <= HEX_CHECK_MAX; bytes++) {
+		// Every byte value at every position
+		for (unsigned start = 0; start < 256; start++) {
+			for (size_t i = 0; i < bytes; i++) {
+				in[i] = (uint8_t) (start + i);
+			}
+			out[bytes * 2] = 0x55;
+			hex_from_bin_ssse3(out, in, bytes, table);
+			hex_from_bin_scalar(expected, in, bytes, table);
+			assert(!memcmp(out, expected, bytes * 2));
+			assert(out[bytes * 2] == 0x55);
+		}
+	}
+}
+
+static void hex_check_to_bin() {
+	uint8_t bin[HEX_CHECK_MAX], in[HEX_CHECK_MAX * 2], out[HEX_CHECK_MAX + 1], expected[HEX_CHECK_MAX];
+	for (size_t i = 0; i < HEX_CHECK_MAX; i++) {
+		bin[i] = (uint8_t) (i * 37 + 11);
+	}
+	for (size_t bytes = 8; bytes <= HEX_CHECK_MAX; bytes++) {
+		// Every character value at every position of an otherwise valid
+		// string, alternating case
+		for (size_t pos = 0; pos < bytes * 2; pos++) {
+			for (unsigned chr = 0; chr < 256; chr++) {
+				hex_from_bin_scalar(in, bin, bytes, (pos & 1) ? hex_upper_table : hex_lower_table);
+				in[pos] = (uint8_t) chr;
+				out[bytes] = 0x55;
+				bool ok = hex_to_bin_ssse3(out, in, bytes);
+				assert(ok == hex_to_bin_scalar(expected, in, bytes));
+				assert(!ok || !memcmp(out, expected, bytes));
+				assert(out[bytes] == 0x55);
+			}
+		}
+	}
+}
+
+static double hex_bench_ns(struct timespec *start) {
+	struct timespec end;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &end));
+	return (double) (end.tv_sec - start->tv_sec) * 1e9 + (double) (end.tv_nsec - start->tv_nsec);
+}
+
+static void hex_bench() {
+	// 14 bytes is a Mode-S long frame
+	uint8_t bin[14], chars[28];
+	volatile uint8_t sink = 0;
+	enum { iterations = 10000000 };
+	for (size_t i = 0; i < sizeof(bin); i++) {
+		bin[i] = (uint8_t) (i * 37 + 11);
+	}
+	struct timespec start;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &start));
+	for (unsigned i = 0; i < iterations; i++) {
+		bin[0] = (uint8_t) i;
+		hex_from_bin_scalar(chars, bin, sizeof(bin), hex_upper_table);
+		sink ^= chars[1];
+	}
+	fprintf(stderr, "hex_from_bin scalar: %.2f ns\n", hex_bench_ns(&start) / (double) iterations);
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &start));
+	for (unsigned i = 0; i < iterations; i++) {
+		bin[0] = (uint8_t) i;
+		hex_from_bin_ssse3(chars, bin, sizeof(bin), hex_upper_table);
+		sink ^= chars[1];
+	}
+	fprintf(stderr, "hex_from_bin ssse3: %.2f ns\n", hex_bench_ns(&start) / (double) iterations);
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &start));
+	for (unsigned i = 0; i < iterations; i++) {
+		chars[1] = hex_upper_table[i & 0xf];
+		assert(hex_to_bin_scalar(bin, chars, sizeof(bin)));
+		sink ^= bin[0];
+	}
+	fprintf(stderr, "hex_to_bin scalar: %.2f ns\n", hex_bench_ns(&start) / (double) iterations);
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &start));
+	for (unsigned i = 0; i < iterations; i++) {
+		chars[1] = hex_upper_table[i & 0xf];
+		assert(hex_to_bin_ssse3(bin, chars, sizeof(bin)));
+		sink ^= bin[0];
+	}
+	fprintf(stderr, "hex_to_bin ssse3: %.2f ns\n", hex_bench_ns(&start) / (double) iterations);
+}
+
+// ADSBUS_HEX_CHECK=on compares the SSSE3 kernels against the scalar tables
+// at startup (run by make test); =bench also times both.
+static void hex_check() {
+	char *mode = getenv("ADSBUS_HEX_CHECK");
+	if (!mode) {
+		return;
+	}
+	assert(!strcmp(mode, "on") || !strcmp(mode, "bench"));
+	if (!hex_ssse3) {
+		fprintf(stderr, "hex: no SSSE3; nothing to check\n");
+		return;
+	}
+	hex_check_from_bin(hex_upper_table);
+	hex_check_from_bin(hex_lower_table);
+	hex_check_to_bin();
+	fprintf(stderr, "hex: SSSE3 kernels match scalar\n");
+	if (!strcmp(mode, "bench")) {
+		hex_bench();
+	}
+}
+
+#endif
+
 void hex_init() {
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	hex_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
 	for (size_t i = 0; i < sizeof(hex_table) / sizeof(*hex_table); i++) {
 		hex_table[i] = HEX_INVALID;
 	}
@@ -23,17 +222,19 @@ void hex_init() {
 	for (uint8_t i = 'A'; i <= 'F'; i++) {
 		hex_table[i] = 10 + i - 'A';
 	}
+
+#ifdef __x86_64__
+	hex_check();
+#endif
 }
 
 bool hex_to_bin(uint8_t *out, const uint8_t *in, size_t bytes) {
-	for (size_t i = 0, j = 0; i < bytes; i++, j += 2) {
-		uint8_t val1 = hex_table[in[j]], val2 = hex_table[in[j + 1]];
-		if (val1 == HEX_INVALID || val2 == HEX_INVALID) {
-			return false;
-		}
-		out[i] = (uint8_t) (val1 << 4) | val2;
+#ifdef __x86_64__
+	if (hex_ssse3 && bytes >= 8) {
+		return hex_to_bin_ssse3(out, in, bytes);
 	}
-	return true;
+#endif
+	return hex_to_bin_scalar(out, in, bytes);
 }
 
 int64_t hex_to_int(const uint8_t *in, size_t bytes) {
@@ -55,10 +256,13 @@ int64_t hex_to_int(const uint8_t *in, size_t bytes) {
 }
 
 static void hex_from_bin(uint8_t *out, const uint8_t *in, size_t bytes, uint8_t table[]) {
-	for (size_t i = 0, j = 0; i < bytes; i++, j += 2) {
-		out[j] = table[in[i] >> 4];
-		out[j + 1] = table[in[i] & 0xf];
+#ifdef __x86_64__
+	if (hex_ssse3 && bytes >= 8) {
+		hex_from_bin_ssse3(out, in, bytes, table);
+		return;
 	}
+#endif
+	hex_from_bin_scalar(out, in, bytes, table);
 }
 
 static void hex_from_int(uint8_t *out, uint64_t in, size_t bytes, uint8_t table[]) {
@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "icao_table.h"
+
+#define ICAO_TABLE_BITS_MIN 10
+#define ICAO_TABLE_USED (1U << 24)
+
+struct icao_table_entry {
+	uint32_t key;
+	uint32_t time_ms;
+};
+
+struct icao_table {
+	uint32_t interval_ms;
+	unsigned bits;
+	size_t count;
+	struct icao_table_entry *entries;
+};
+
+static size_t icao_table_hash(const struct icao_table *table, uint32_t key) {
+	return (size_t) ((key * 0x9e3779b1U) >> (32 - table->bits));
+}
+
+static bool icao_table_expired(const struct icao_table *table, const struct icao_table_entry *entry, uint32_t now_ms) {
+	return now_ms - entry->time_ms >= table->interval_ms;
+}
+
+static struct icao_table_entry *icao_table_find(struct icao_table *table, uint32_t key) {
+	size_t mask = ((size_t) 1 << table->bits) - 1;
+	for (size_t i = icao_table_hash(table, key);; i = (i + 1) & mask) {
+		struct icao_table_entry *entry = &table->entries[i];
+		if (!entry->key || entry->key == key) {
+			return entry;
+		}
+	}
+}
+
+static void icao_table_resize(struct icao_table *table, uint32_t now_ms) {
+	// Expired entries would let the next packet through anyway; drop them
+	// rather than carry them into the new table.
+	size_t old_size = (size_t) 1 << table->bits;
+	struct icao_table_entry *old_entries = table->entries;
+	size_t live = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		if (old_entries[i].key && !icao_table_expired(table, &old_entries[i], now_ms)) {
+			live++;
+		}
+	}
+	table->bits = ICAO_TABLE_BITS_MIN;
+	while (((size_t) 1 << table->bits) < live * 4) {
+		table->bits++;
+	}
+	table->entries = calloc((size_t) 1 << table->bits, sizeof(*table->entries));
+	assert(table->entries);
+	table->count = 0;
+	for (size_t i = 0; i < old_size; i++) {
+		if (old_entries[i].key && !icao_table_expired(table, &old_entries[i], now_ms)) {
+			*icao_table_find(table, old_entries[i].key) = old_entries[i];
+			table->count++;
+		}
+	}
+	free(old_entries);
+}
+
+struct icao_table *icao_table_new(uint64_t interval_ms) {
+	assert(interval_ms && interval_ms <= UINT32_MAX);
+	struct icao_table *table = malloc(sizeof(*table));
+	assert(table);
+	table->interval_ms = (uint32_t) interval_ms;
+	table->bits = ICAO_TABLE_BITS_MIN;
+	table->count = 0;
+	table->entries = calloc((size_t) 1 << table->bits, sizeof(*table->entries));
+	assert(table->entries);
+	return table;
+}
+
+void icao_table_del(struct icao_table *table) {
+	free(table->entries);
+	free(table);
+}
+
+static uint32_t icao_table_key(uint32_t icao) {
+	return (icao & (ICAO_TABLE_USED - 1)) | ICAO_TABLE_USED;
+}
+
+static void icao_table_insert(struct icao_table *table, uint32_t key, uint32_t now_ms) {
+	struct icao_table_entry *entry = icao_table_find(table, key);
+	if ((table->count + 1) * 2 > (size_t) 1 << table->bits) {
+		icao_table_resize(table, now_ms);
+		entry = icao_table_find(table, key);
+	}
+	entry->key = key;
+	entry->time_ms = now_ms;
+	table->count++;
+}
+
+bool icao_table_check(struct icao_table *table, uint32_t icao, uint64_t now_ms_64) {
+	// Returns true (and restarts the interval) if icao hasn't been let through
+	// in the last interval_ms. Times wrap at 32 bits, which is fine for
+	// intervals well under 49 days.
+	uint32_t now_ms = (uint32_t) now_ms_64;
+	uint32_t key = icao_table_key(icao);
+	struct icao_table_entry *entry = icao_table_find(table, key);
+	if (entry->key) {
+		if (!icao_table_expired(table, entry, now_ms)) {
+			return false;
+		}
+		entry->time_ms = now_ms;
+		return true;
+	}
+	icao_table_insert(table, key, now_ms);
+	return true;
+}
+
+void icao_table_touch(struct icao_table *table, uint32_t icao, uint64_t now_ms_64) {
+	uint32_t now_ms = (uint32_t) now_ms_64;
+	uint32_t key = icao_table_key(icao);
+	struct icao_table_entry *entry = icao_table_find(table, key);
+	if (entry->key) {
+		entry->time_ms = now_ms;
+		return;
+	}
+	icao_table_insert(table, key, now_ms);
+}
+
+bool icao_table_seen(struct icao_table *table, uint32_t icao, uint64_t now_ms_64) {
+	// Returns true if icao was touched in the last interval_ms.
+	struct icao_table_entry *entry = icao_table_find(table, icao_table_key(icao));
+	return entry->key && !icao_table_expired(table, entry, (uint32_t) now_ms_64);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Open-addressed table of ICAO address -> last time let through, for
+// per-aircraft rate limiting, or last time seen, for recency checks.
+struct icao_table;
+
+struct icao_table *icao_table_new(uint64_t);
+void icao_table_del(struct icao_table *);
+bool __attribute__ ((warn_unused_result)) icao_table_check(struct icao_table *, uint32_t, uint64_t);
+void icao_table_touch(struct icao_table *, uint32_t, uint64_t);
+bool __attribute__ ((warn_unused_result)) icao_table_seen(struct icao_table *, uint32_t, uint64_t);
@@ -10,6 +10,8 @@
 #include "rand.h"
 #include "receive.h"
 #include "server.h"
+#include "source.h"
+#include "uuid.h"
 
 #include "json.h"
 
@@ -23,8 +25,8 @@ struct json_parser_state {
 	bool have_header;
 };
 
-static json_t *json_prev = NULL;
-static struct buf json_hello_buf = BUF_INIT;
+static uint8_t json_hello_data[BUF_LEN_MAX];
+static struct buf json_hello_buf = BUF_INIT(json_hello_data);
 
 static char log_module = 'R'; // borrowing
 
@@ -34,25 +36,68 @@ static void json_serialize_to_buf(json_t *obj, struct buf *buf) {
 	buf_chr(buf, buf->length++) = '\n';
 }
 
-static void json_add_common(struct packet *packet, json_t *obj) {
-	json_object_set_new(obj, "hops", json_integer(packet->hops));
-	json_object_set_new(obj, "type", json_string(packet_type_names[packet->type]));
-	json_object_set_new(obj, "source_id", json_string((const char *) packet->source_id));
-	if (packet->mlat_timestamp) {
-		json_object_set_new(obj, "mlat_timestamp", json_integer(packet->mlat_timestamp % INT64_MAX));
-	}
-	if (packet->rssi) {
-		json_object_set_new(obj, "rssi", json_integer(packet->rssi));
+static void json_append(struct buf *buf, const void *data, size_t len) {
+	memcpy(buf_at(buf, buf->length), data, len);
+	buf->length += len;
+}
+
+#define json_append_literal(buf, str) json_append(buf, str, sizeof(str) - 1)
+
+static void json_append_uint(struct buf *buf, uint64_t val) {
+	uint8_t digits[20];
+	size_t i = sizeof(digits);
+	do {
+		digits[--i] = (uint8_t) ('0' + (val % 10));
+		val /= 10;
+	} while (val);
+	json_append(buf, &digits[i], sizeof(digits) - i);
+}
+
+// `, "source_id": "..."` for the last source we serialized, escaped the way
+// jansson would.
+static struct source_cache json_source_cache;
+static uint8_t json_source_id_fragment[32 + (UUID_LEN * 2)];
+static size_t json_source_id_fragment_len = 0;
+
+static void json_append_source_id(struct buf *buf, uint32_t source) {
+	if (!source_cache_hit(&json_source_cache, source)) {
+		struct buf fragment = BUF_INIT(json_source_id_fragment);
+		json_append_literal(&fragment, ", \"source_id\": \"");
+		for (const uint8_t *iter = source_get(source); *iter; iter++) {
+			// packet_validate_id() guarantees printable ASCII
+			if (*iter == '"' || *iter == '\\') {
+				buf_chr(&fragment, fragment.length++) = '\\';
+			}
+			buf_chr(&fragment, fragment.length++) = *iter;
+		}
+		buf_chr(&fragment, fragment.length++) = '"';
+		json_source_id_fragment_len = fragment.length;
 	}
+	json_append(buf, json_source_id_fragment, json_source_id_fragment_len);
 }
 
 static void json_serialize_payload(struct packet *packet, struct buf *buf) {
+	// Byte-for-byte what json_dump_callback() used to produce for the same
+	// object: insertion order, ", " and ": " separators.
 	size_t bytes = packet_payload_len[packet->type];
-	uint8_t hexbuf[PACKET_PAYLOAD_LEN_MAX * 2];
-	hex_from_bin_upper(hexbuf, packet->payload, bytes);
-	json_t *out = json_pack("{ss#}", "payload", hexbuf, bytes * 2);
-	json_add_common(packet, out);
-	json_serialize_to_buf(out, buf);
+	json_append_literal(buf, "{\"payload\": \"");
+	hex_from_bin_upper(buf_at(buf, buf->length), packet->payload, bytes);
+	buf->length += bytes * 2;
+	json_append_literal(buf, "\", \"hops\": ");
+	json_append_uint(buf, packet->hops);
+	json_append_literal(buf, ", \"type\": \"");
+	json_append(buf, packet_type_names[packet->type], strlen(packet_type_names[packet->type]));
+	buf_chr(buf, buf->length++) = '"';
+	json_append_source_id(buf, packet->source);
+	if (packet->mlat_timestamp) {
+		json_append_literal(buf, ", \"mlat_timestamp\": ");
+		json_append_uint(buf, packet->mlat_timestamp % INT64_MAX);
+	}
+	if (packet->rssi) {
+		json_append_literal(buf, ", \"rssi\": ");
+		json_append_uint(buf, packet->rssi);
+	}
+	json_append_literal(buf, "}\n");
 }
 
 static bool json_parse_header(json_t *in, struct packet *packet, struct json_parser_state *state) {
@@ -81,11 +126,11 @@ static bool json_parse_header(json_t *in, struct packet *packet, struct json_par
 	}
 
 	if (!strcmp(json_server_id, (const char *) server_id)) {
-		LOG(packet->source_id, "Attempt to receive json data from our own server ID (%s); loop!", server_id);
+		LOG(source_get(packet->source), "Attempt to receive json data from our own server ID (%s); loop!", server_id);
 		return false;
 	}
 
-	LOG(packet->source_id, "Connected to server ID: %s", json_server_id);
+	LOG(source_get(packet->source), "Connected to server ID: %s", json_server_id);
 
 	state->mlat_timestamp_mhz = (uint16_t) mlat_timestamp_mhz;
 	state->mlat_timestamp_max = (uint64_t) mlat_timestamp_max;
@@ -101,18 +146,20 @@ static bool json_parse_common(json_t *in, struct packet *packet, struct json_par
 		return false;
 	}
 
+	const char *source_id;
 	json_int_t hops;
 
 	if (json_unpack(
 			in, "{s:s, s:I}",
-			"source_id", &packet->source_id,
+			"source_id", &source_id,
 			"hops", &hops)) {
 		return false;
 	}
 
-	if (!packet_validate_id(packet->source_id)) {
+	if (!packet_validate_id((const uint8_t *) source_id)) {
 		return false;
 	}
+	packet->source = source_intern((const uint8_t *) source_id);
 
 	if (hops < 0 || hops > UINT32_MAX) {
 		return false;
@@ -174,6 +221,278 @@ static bool json_parse_mode_s_long(json_t *in, struct packet *packet, struct jso
 	return json_parse_payload(in, packet, state, PACKET_TYPE_MODE_S_LONG);
 }
 
+// Fast path for packet lines in the shape we emit: one flat object per line,
+// plain strings and integers only. Anything it isn't sure about (headers,
+// escapes, non-ASCII, floats, nesting, duplicate keys) is handed to jansson,
+// so the accepted language is unchanged.
+
+enum json_fast_result {
+	JSON_FAST_FALLBACK,
+	JSON_FAST_REJECT,
+	JSON_FAST_OK,
+};
+
+enum json_fast_key {
+	JSON_KEY_TYPE,
+	JSON_KEY_SOURCE_ID,
+	JSON_KEY_HOPS,
+	JSON_KEY_MLAT_TIMESTAMP,
+	JSON_KEY_RSSI,
+	JSON_KEY_PAYLOAD,
+	NUM_JSON_KEYS,
+};
+
+static const char *json_fast_key_names[] = {
+	"type",
+	"source_id",
+	"hops",
+	"mlat_timestamp",
+	"rssi",
+	"payload",
+};
+
+struct json_fast_value {
+	const uint8_t *str;
+	size_t len;
+	json_int_t integer;
+	bool is_integer;
+};
+
+#define JSON_FAST_UNKNOWN_KEYS_MAX 8
+
+static const uint8_t *json_fast_skip_space(const uint8_t *ptr, const uint8_t *end) {
+	while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n')) {
+		ptr++;
+	}
+	return ptr;
+}
+
+static const uint8_t *json_fast_string(const uint8_t *ptr, const uint8_t *end, const uint8_t **str, size_t *len) {
+	if (ptr >= end || *ptr != '"') {
+		return NULL;
+	}
+	ptr++;
+	const uint8_t *close = memchr(ptr, '"', (size_t) (end - ptr));
+	if (!close) {
+		return NULL;
+	}
+	for (const uint8_t *iter = ptr; iter < close; iter++) {
+		if (*iter == '\\' || *iter < 0x20 || *iter >= 0x80) {
+			return NULL;
+		}
+	}
+	*str = ptr;
+	*len = (size_t) (close - ptr);
+	return close + 1;
+}
+
+static const uint8_t *json_fast_integer(const uint8_t *ptr, const uint8_t *end, json_int_t *out) {
+	bool negative = (ptr < end && *ptr == '-');
+	if (negative) {
+		ptr++;
+	}
+	const uint8_t *start = ptr;
+	uint64_t val = 0;
+	while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+		val = val * 10 + (uint64_t) (*ptr - '0');
+		ptr++;
+	}
+	size_t digits = (size_t) (ptr - start);
+	// 18 digits can't overflow; leave the rest and leading zeros to jansson
+	if (!digits || digits > 18 || (*start == '0' && digits > 1)) {
+		return NULL;
+	}
+	if (ptr < end && (*ptr == '.' || *ptr == 'e' || *ptr == 'E')) {
+		return NULL;
+	}
+	*out = negative ? -(json_int_t) val : (json_int_t) val;
+	return ptr;
+}
+
+static enum json_fast_result json_fast_scan(const uint8_t *ptr, const uint8_t *end, struct json_fast_value values[], const uint8_t **object_end) {
+	const uint8_t *unknown_keys[JSON_FAST_UNKNOWN_KEYS_MAX];
+	size_t unknown_lens[JSON_FAST_UNKNOWN_KEYS_MAX];
+	size_t num_unknown = 0;
+	uint32_t seen = 0;
+
+	ptr = json_fast_skip_space(ptr, end);
+	if (ptr >= end || *ptr != '{') {
+		return JSON_FAST_FALLBACK;
+	}
+	ptr = json_fast_skip_space(ptr + 1, end);
+
+	while (true) {
+		const uint8_t *key;
+		size_t key_len;
+		ptr = json_fast_string(ptr, end, &key, &key_len);
+		if (!ptr) {
+			return JSON_FAST_FALLBACK;
+		}
+
+		struct json_fast_value *value = NULL;
+		for (size_t i = 0; i < NUM_JSON_KEYS; i++) {
+			if (strlen(json_fast_key_names[i]) == key_len && !memcmp(json_fast_key_names[i], key, key_len)) {
+				if (seen & (1U << i)) {
+					return JSON_FAST_FALLBACK;
+				}
+				seen |= (1U << i);
+				value = &values[i];
+				break;
+			}
+		}
+		if (!value) {
+			if (num_unknown == JSON_FAST_UNKNOWN_KEYS_MAX) {
+				return JSON_FAST_FALLBACK;
+			}
+			for (size_t i = 0; i < num_unknown; i++) {
+				if (unknown_lens[i] == key_len && !memcmp(unknown_keys[i], key, key_len)) {
+					return JSON_FAST_FALLBACK;
+				}
+			}
+			unknown_keys[num_unknown] = key;
+			unknown_lens[num_unknown++] = key_len;
+		}
+
+		ptr = json_fast_skip_space(ptr, end);
+		if (ptr >= end || *ptr != ':') {
+			return JSON_FAST_FALLBACK;
+		}
+		ptr = json_fast_skip_space(ptr + 1, end);
+
+		struct json_fast_value scratch;
+		if (!value) {
+			value = &scratch;
+		}
+		if (ptr < end && *ptr == '"') {
+			ptr = json_fast_string(ptr, end, &value->str, &value->len);
+			value->is_integer = false;
+		} else {
+			ptr = json_fast_integer(ptr, end, &value->integer);
+			value->str = NULL;
+			value->is_integer = true;
+		}
+		if (!ptr) {
+			return JSON_FAST_FALLBACK;
+		}
+
+		ptr = json_fast_skip_space(ptr, end);
+		if (ptr >= end) {
+			return JSON_FAST_FALLBACK;
+		}
+		if (*ptr == '}') {
+			break;
+		}
+		if (*ptr != ',') {
+			return JSON_FAST_FALLBACK;
+		}
+		ptr = json_fast_skip_space(ptr + 1, end);
+	}
+
+	for (size_t i = 0; i < NUM_JSON_KEYS; i++) {
+		if (!(seen & (1U << i))) {
+			values[i].str = NULL;
+			values[i].is_integer = false;
+		}
+	}
+	*object_end = ptr + 1;
+	return JSON_FAST_OK;
+}
+
+static enum json_fast_result json_parse_fast(struct buf *buf, size_t offset, struct packet *packet, struct json_parser_state *state) {
+	const uint8_t *start = buf_at(buf, offset);
+	const uint8_t *line_end = memchr(start, '\n', buf->length - offset);
+	if (!line_end) {
+		return JSON_FAST_FALLBACK;
+	}
+
+	struct json_fast_value values[NUM_JSON_KEYS];
+	const uint8_t *object_end;
+	if (json_fast_scan(start, line_end, values, &object_end) != JSON_FAST_OK) {
+		return JSON_FAST_FALLBACK;
+	}
+	if (object_end < line_end && *object_end == '\r') {
+		object_end++;
+	}
+	if (object_end != line_end) {
+		return JSON_FAST_FALLBACK;
+	}
+
+	struct json_fast_value *type_value = &values[JSON_KEY_TYPE];
+	if (!type_value->str) {
+		return JSON_FAST_FALLBACK;
+	}
+	enum packet_type type = PACKET_TYPE_NONE;
+	for (enum packet_type i = PACKET_TYPE_MODE_AC; i <= PACKET_TYPE_MODE_S_LONG; i++) {
+		if (strlen(packet_type_names[i]) == type_value->len && !memcmp(packet_type_names[i], type_value->str, type_value->len)) {
+			type = i;
+			break;
+		}
+	}
+	if (type == PACKET_TYPE_NONE) {
+		return JSON_FAST_FALLBACK;
+	}
+
+	// From here on, the same checks in the same order as json_parse_common()
+	// and json_parse_payload().
+	if (!state->have_header) {
+		return JSON_FAST_REJECT;
+	}
+
+	struct json_fast_value *source_id = &values[JSON_KEY_SOURCE_ID];
+	struct json_fast_value *hops = &values[JSON_KEY_HOPS];
+	if (!source_id->str || !hops->is_integer) {
+		return JSON_FAST_REJECT;
+	}
+	if (source_id->len >= UUID_LEN) {
+		return JSON_FAST_REJECT;
+	}
+	uint8_t id[UUID_LEN];
+	memcpy(id, source_id->str, source_id->len);
+	id[source_id->len] = '\0';
+	if (!packet_validate_id(id)) {
+		return JSON_FAST_REJECT;
+	}
+	packet->source = source_intern(id);
+
+	if (hops->integer < 0 || hops->integer > UINT32_MAX) {
+		return JSON_FAST_REJECT;
+	}
+	packet->hops = (uint16_t) hops->integer;
+
+	struct json_fast_value *mlat_timestamp = &values[JSON_KEY_MLAT_TIMESTAMP];
+	if (mlat_timestamp->is_integer) {
+		if (mlat_timestamp->integer < 0) {
+			return JSON_FAST_REJECT;
+		}
+		packet->mlat_timestamp = packet_mlat_timestamp_scale_in(
+				(uint64_t) mlat_timestamp->integer,
+				state->mlat_timestamp_max,
+				state->mlat_timestamp_mhz,
+				&state->mlat_state);
+	}
+
+	struct json_fast_value *rssi = &values[JSON_KEY_RSSI];
+	if (rssi->is_integer) {
+		if (rssi->integer > state->rssi_max) {
+			return JSON_FAST_REJECT;
+		}
+		packet->rssi = packet_rssi_scale_in((uint32_t) rssi->integer, state->rssi_max);
+	}
+
+	size_t bytes = packet_payload_len[type];
+	struct json_fast_value *payload = &values[JSON_KEY_PAYLOAD];
+	if (!payload->str || payload->len != bytes * 2) {
+		return JSON_FAST_REJECT;
+	}
+	if (!hex_to_bin(packet->payload, payload->str, bytes)) {
+		return JSON_FAST_REJECT;
+	}
+	packet->type = type;
+
+	buf_consume(buf, offset + (size_t) (line_end - start) + 1);
+	return JSON_FAST_OK;
+}
+
 void json_init() {
 	assert(sizeof(struct json_parser_state) <= PARSER_STATE_LEN);
 	assert(JSON_INTEGER_IS_LONG_LONG);
@@ -194,22 +513,52 @@ void json_init() {
 	json_serialize_to_buf(hello, &json_hello_buf);
 }
 
-void json_cleanup() {
-	if (json_prev) {
-		json_decref(json_prev);
+// Blank lines and whitespace between objects aren't corruption. They're
+// only consumed along with the object that follows, so a failed parse
+// leaves the buffer untouched for the next parser.
+static size_t json_leading_space(const struct buf *buf) {
+	// The same set json_loadb() skips
+	for (size_t i = 0; i < buf->length; i++) {
+		switch (buf_chr(buf, i)) {
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				continue;
+
+			default:
+				return i;
+		}
 	}
+	return buf->length;
+}
+
+uint8_t json_score(const struct buf *buf) {
+	size_t offset = json_leading_space(buf);
+	return (offset < buf->length && buf_chr(buf, offset) == '{') ? 80 : 0;
 }
 
 bool json_parse(struct buf *buf, struct packet *packet, void *state_in) {
 	struct json_parser_state *state = (struct json_parser_state *) state_in;
 
-	if (json_prev) {
-		json_decref(json_prev);
-		json_prev = NULL;
+	size_t offset = json_leading_space(buf);
+	if (offset == buf->length) {
+		return false;
+	}
+
+	switch (json_parse_fast(buf, offset, packet, state)) {
+		case JSON_FAST_OK:
+			return true;
+
+		case JSON_FAST_REJECT:
+			return false;
+
+		case JSON_FAST_FALLBACK:
+			break;
 	}
 
 	json_error_t err;
-	json_t *in = json_loadb((const char *) buf_at(buf, 0), buf->length, JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES, &err);
+	json_t *in = json_loadb((const char *) buf_at(buf, offset), buf->length - offset, JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES, &err);
 	if (!in) {
 		return false;
 	}
@@ -240,15 +589,43 @@ bool json_parse(struct buf *buf, struct packet *packet, void *state_in) {
 		return false;
 	}
 
+	json_decref(in);
 	assert(err.position > 0);
-	buf_consume(buf, (size_t) err.position);
-	while (buf->length && (buf_chr(buf, 0) == '\r' || buf_chr(buf, 0) == '\n')) {
-		buf_consume(buf, 1);
-	}
-	json_prev = in;
+	buf_consume(buf, offset + (size_t) err.position);
 	return true;
 }
 
+// A well-formed object we didn't accept is skipped whole, except a header:
+// one we rejected (our own server ID, bad magic) means the stream isn't
+// for us, so it stays put until the input overruns and is dropped.
+// Anything else jansson rejects before running out of input is garbage up
+// to the end of the line. 0 means the head might just be an incomplete
+// (possibly multi-line) object.
+size_t json_resync(const struct buf *buf) {
+	size_t offset = json_leading_space(buf);
+	json_error_t err;
+	json_t *in = json_loadb((const char *) buf_at(buf, offset), buf->length - offset, JSON_DISABLE_EOF_CHECK | JSON_REJECT_DUPLICATES, &err);
+	if (in) {
+		json_t *type = json_is_object(in) ? json_object_get(in, "type") : NULL;
+		bool header = type && json_is_string(type) && !strcmp(json_string_value(type), "header");
+		json_decref(in);
+		if (header) {
+			return 0;
+		}
+		assert(err.position > 0);
+		return offset + (size_t) err.position;
+	}
+	if (json_error_code(&err) == json_error_premature_end_of_input) {
+		return 0;
+	}
+	for (size_t i = offset; i < buf->length; i++) {
+		if (buf_chr(buf, i) == '\n') {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
 void json_serialize(struct packet *packet, struct buf *buf) {
 	switch (packet->type) {
 		case PACKET_TYPE_NONE:
@@ -268,7 +645,7 @@ void json_hello(struct buf **buf) {
 
 int json_buf_append_callback(const char *buffer, size_t size, void *data) {
 	struct buf *buf = data;
-	if (buf->length + size + 1 > BUF_LEN_MAX) {
+	if (buf->start + buf->length + size + 1 > buf->size) {
 		return -1;
 	}
 	memcpy(buf_at(buf, buf->length), buffer, size);
@@ -1,13 +1,16 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct buf;
 struct packet;
 
 void json_init(void);
-void json_cleanup(void);
+uint8_t __attribute__ ((warn_unused_result)) json_score(const struct buf *);
 bool __attribute__ ((warn_unused_result)) json_parse(struct buf *, struct packet *, void *);
+size_t __attribute__ ((warn_unused_result)) json_resync(const struct buf *);
 void json_serialize(struct packet *, struct buf *);
 void json_hello(struct buf **);
 
@@ -67,7 +67,8 @@ static void outgoing_connect_next(struct outgoing *outgoing) {
 	outgoing->peer.fd = socket(outgoing->addr->ai_family, outgoing->addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, outgoing->addr->ai_protocol);
 	assert(outgoing->peer.fd >= 0);
 
-	struct buf buf = BUF_INIT, *buf_ptr = &buf;
+	uint8_t data[BUF_LEN_MAX];
+	struct buf buf = BUF_INIT(data), *buf_ptr = &buf;
 	flow_get_hello(outgoing->flow, &buf_ptr, outgoing->passthrough);
 	ssize_t result = sendto(outgoing->peer.fd, buf_at(buf_ptr, 0), buf_ptr->length, MSG_FASTOPEN, outgoing->addr->ai_addr, outgoing->addr->ai_addrlen);
 	outgoing_connect_result(outgoing, result == (ssize_t) buf_ptr->length ? EINPROGRESS : errno);
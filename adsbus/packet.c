@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <string.h>
 
+#include "crc.h"
+#include "source.h"
 #include "uuid.h"
 
 #include "packet.h"
@@ -21,6 +23,17 @@ size_t packet_payload_len[] = {
 	14,
 };
 
+// Type for a payload of the given number of hex characters, or
+// PACKET_TYPE_NONE.
+enum packet_type packet_type_from_text_len(size_t len) {
+	for (enum packet_type type = PACKET_TYPE_MODE_AC; type <= PACKET_TYPE_MODE_S_LONG; type++) {
+		if (packet_payload_len[type] * 2 == len) {
+			return type;
+		}
+	}
+	return PACKET_TYPE_NONE;
+}
+
 static uint64_t packet_mlat_timestamp_scale_mhz_in(uint64_t timestamp, uint32_t mhz) {
 	assert(mhz > 0);
 	return timestamp * (PACKET_MLAT_MHZ / mhz);
@@ -65,12 +78,24 @@ uint32_t packet_rssi_scale_out(uint32_t value, uint32_t max) {
 }
 
 void packet_sanity_check(const struct packet *packet) {
-	assert(packet_validate_id(packet->source_id));
+	assert(source_valid(packet->source));
 	assert(packet->type > PACKET_TYPE_NONE && packet->type < NUM_TYPES);
 	assert(packet->mlat_timestamp <= PACKET_MLAT_MAX);
 	assert(packet->rssi <= PACKET_RSSI_MAX);
 }
 
+void packet_batch_sanity_check(const struct packet_batch *batch) {
+	assert(batch->count > 0 && batch->count <= PACKET_BATCH_MAX);
+	for (size_t i = 0; i < batch->count; i++) {
+		const struct packet *packet = &batch->packets[i];
+		assert(source_valid(packet->source));
+		assert(packet->input_stat == batch->packets[0].input_stat);
+		assert(packet->type > PACKET_TYPE_NONE && packet->type < NUM_TYPES);
+		assert(packet->mlat_timestamp <= PACKET_MLAT_MAX);
+		assert(packet->rssi <= PACKET_RSSI_MAX);
+	}
+}
+
 bool packet_validate_id(const uint8_t *id) {
 	if (!id) {
 		return false;
@@ -86,3 +111,34 @@ bool packet_validate_id(const uint8_t *id) {
 	}
 	return false;
 }
+
+bool packet_get_icao(const struct packet *packet, uint32_t *icao) {
+	if (packet->type != PACKET_TYPE_MODE_S_SHORT && packet->type != PACKET_TYPE_MODE_S_LONG) {
+		return false;
+	}
+	size_t len = packet_payload_len[packet->type];
+	const uint8_t *payload = packet->payload;
+	uint32_t tail = (uint32_t) payload[len - 3] << 16 | (uint32_t) payload[len - 2] << 8 | payload[len - 1];
+	switch (payload[0] >> 3) {
+		case 11:
+		case 17:
+		case 18:
+			// Address announced in the clear
+			*icao = (uint32_t) payload[1] << 16 | (uint32_t) payload[2] << 8 | payload[3];
+			return true;
+
+		case 0:
+		case 4:
+		case 5:
+		case 16:
+		case 20:
+		case 21:
+			// Address/parity: the address is whatever makes the CRC come out right.
+			// Unverified, so noise yields random addresses.
+			*icao = crc_mode_s(payload, len - 3) ^ tail;
+			return true;
+
+		default:
+			return false;
+	}
+}
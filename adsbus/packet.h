@@ -7,7 +7,7 @@ struct stat;
 
 #define PACKET_DATA_LEN_MAX 14
 struct packet {
-	const uint8_t *source_id;
+	uint32_t source;
 	struct stat *input_stat;
 	enum packet_type {
 		PACKET_TYPE_NONE,
@@ -21,6 +21,16 @@ struct packet {
 	uint64_t mlat_timestamp;
 	uint32_t rssi;
 };
+
+// Packets parsed from one input in one pass, handed to send together.
+// duplicate marks copies of packets recently seen from another source.
+#define PACKET_BATCH_MAX 64
+struct packet_batch {
+	struct packet packets[PACKET_BATCH_MAX];
+	bool duplicate[PACKET_BATCH_MAX];
+	size_t count;
+};
+
 extern char *packet_type_names[];
 extern size_t packet_payload_len[];
 
@@ -43,4 +53,7 @@ uint32_t __attribute__ ((warn_unused_result)) packet_rssi_scale_in(uint32_t, uin
 uint32_t __attribute__ ((warn_unused_result)) packet_rssi_scale_out(uint32_t, uint32_t);
 
 void packet_sanity_check(const struct packet *);
+void packet_batch_sanity_check(const struct packet_batch *);
 bool __attribute__ ((warn_unused_result)) packet_validate_id(const uint8_t *);
+bool __attribute__ ((warn_unused_result)) packet_get_icao(const struct packet *, uint32_t *);
+enum packet_type __attribute__ ((warn_unused_result)) packet_type_from_text_len(size_t);
@@ -18,6 +18,8 @@ static int peer_epoll_fd;
 static struct peer peer_shutdown_peer;
 static bool peer_shutdown_flag = false;
 static struct list_head peer_always_trigger_head = LIST_HEAD_INIT(peer_always_trigger_head);
+static struct list_head peer_loop_hook_head = LIST_HEAD_INIT(peer_loop_hook_head);
+static struct list_head peer_ready_head = LIST_HEAD_INIT(peer_ready_head);
 
 static void peer_shutdown() {
 	peer_close(&peer_shutdown_peer);
@@ -59,6 +61,7 @@ void peer_epoll_add(struct peer *peer, uint32_t events) {
 		},
 	};
 	peer->always_trigger = false;
+	peer->ready = false;
 	int res = epoll_ctl(peer_epoll_fd, EPOLL_CTL_ADD, peer->fd, &ev);
 	if (res == -1 && errno == EPERM) {
 		// Not a socket
@@ -71,7 +74,33 @@ void peer_epoll_add(struct peer *peer, uint32_t events) {
 	}
 }
 
+void peer_epoll_mod(struct peer *peer, uint32_t events) {
+	struct epoll_event ev = {
+		.events = events,
+		.data = {
+			.ptr = peer,
+		},
+	};
+	int res = epoll_ctl(peer_epoll_fd, EPOLL_CTL_MOD, peer->fd, &ev);
+	if (res == -1 && errno == EPERM) {
+		// Not a socket
+		if (events && !peer->always_trigger) {
+			list_add(&peer->peer_always_trigger_list, &peer_always_trigger_head);
+			peer->always_trigger = true;
+		} else if (!events && peer->always_trigger) {
+			list_del(&peer->peer_always_trigger_list);
+			peer->always_trigger = false;
+		}
+	} else {
+		assert(!res);
+	}
+}
+
 void peer_epoll_del(struct peer *peer) {
+	if (peer->ready) {
+		list_del(&peer->peer_ready_list);
+		peer->ready = false;
+	}
 	int res = epoll_ctl(peer_epoll_fd, EPOLL_CTL_DEL, peer->fd, NULL);
 	if (res == -1 && errno == EPERM) {
 		if (peer->always_trigger) {
@@ -98,6 +127,21 @@ void peer_call(struct peer *peer) {
 	peer->event_handler(peer);
 }
 
+void peer_loop_hook_add(struct peer *peer) {
+	// Called once at the end of every event loop iteration
+	list_add(&peer->peer_loop_hook_list, &peer_loop_hook_head);
+}
+
+void peer_ready_add(struct peer *peer) {
+	// Called again next iteration without waiting for an event. For
+	// edge-triggered peers that stopped short of EAGAIN.
+	if (peer->ready) {
+		return;
+	}
+	list_add(&peer->peer_ready_list, &peer_ready_head);
+	peer->ready = true;
+}
+
 void peer_loop() {
 	LOG(server_id, "Starting event loop");
 	while (!peer_shutdown_flag) {
@@ -112,15 +156,36 @@ void peer_loop() {
 		}
 #define MAX_EVENTS 10
 		struct epoll_event events[MAX_EVENTS];
-		int delay = list_is_empty(&peer_always_trigger_head) ? -1 : 0;
+		int delay = list_is_empty(&peer_always_trigger_head) && list_is_empty(&peer_ready_head) ? -1 : 0;
 		int nfds = epoll_wait(peer_epoll_fd, events, MAX_EVENTS, delay);
 		if (nfds == -1 && errno == EINTR) {
 			continue;
 		}
 		assert(nfds >= 0);
 
-    for (int n = 0; n < nfds; n++) {
+		// Peers made ready during the last iteration run in this one
+		struct list_head ready_head = LIST_HEAD_INIT(ready_head);
+		{
+			struct peer *iter, *next;
+			list_for_each_entry_safe(iter, next, &peer_ready_head, peer_ready_list) {
+				list_del(&iter->peer_ready_list);
+				list_add(&iter->peer_ready_list, &ready_head);
+			}
+		}
+
+		for (int n = 0; n < nfds; n++) {
 			struct peer *peer = events[n].data.ptr;
+			if (peer->ready) {
+				list_del(&peer->peer_ready_list);
+				peer->ready = false;
+			}
+			peer_call(peer);
+		}
+
+		while (!list_is_empty(&ready_head)) {
+			struct peer *peer = list_entry(ready_head.next, struct peer, peer_ready_list);
+			list_del(&peer->peer_ready_list);
+			peer->ready = false;
 			peer_call(peer);
 		}
 
@@ -130,5 +195,12 @@ void peer_loop() {
 				peer_call(iter);
 			}
 		}
+
+		{
+			struct peer *iter;
+			list_for_each_entry(iter, &peer_loop_hook_head, peer_loop_hook_list) {
+				peer_call(iter);
+			}
+		}
 	}
 }
@@ -11,7 +11,10 @@ struct peer {
 	int fd;
 	peer_event_handler event_handler;
 	struct list_head peer_always_trigger_list;
+	struct list_head peer_loop_hook_list;
+	struct list_head peer_ready_list;
 	bool always_trigger;
+	bool ready;
 };
 
 extern uint32_t peer_count_in, peer_count_out, peer_count_out_in;
@@ -19,7 +22,10 @@ extern uint32_t peer_count_in, peer_count_out, peer_count_out_in;
 void peer_init(void);
 void peer_cleanup(void);
 void peer_epoll_add(struct peer *, uint32_t);
+void peer_epoll_mod(struct peer *, uint32_t);
 void peer_epoll_del(struct peer *);
 void peer_close(struct peer *);
 void peer_call(struct peer *);
+void peer_loop_hook_add(struct peer *);
+void peer_ready_add(struct peer *);
 void peer_loop(void);
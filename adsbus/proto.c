@@ -5,6 +5,8 @@
 #include "log.h"
 #include "packet.h"
 #include "server.h"
+#include "source.h"
+#include "uuid.h"
 
 #include "adsb.pb-c.h"
 #include "proto.h"
@@ -24,8 +26,9 @@ struct proto_parser_state {
 
 static char log_module = 'R'; // borrowing
 
-static Adsb *proto_prev = NULL;
-static struct buf proto_hello_buf = BUF_INIT;
+static char proto_source_id[UUID_LEN];
+static uint8_t proto_hello_data[BUF_LEN_MAX];
+static struct buf proto_hello_buf = BUF_INIT(proto_hello_data);
 
 static void proto_obj_to_buf(ProtobufCMessage *obj, struct buf *buf) {
 	assert(!buf->length);
@@ -41,43 +44,83 @@ static void proto_wrap_to_buf(Adsb *msg, struct buf *buf) {
 	proto_obj_to_buf((struct ProtobufCMessage *) &wrapper, buf);
 }
 
-static void proto_serialize_packet(struct packet *packet, AdsbPacket *out, size_t len) {
-	out->source_id = (char *) packet->source_id;
-	out->hops = packet->hops;
-	if (packet->mlat_timestamp) {
-		out->mlat_timestamp = packet->mlat_timestamp;
-		out->has_mlat_timestamp = true;
-	}
-	if (packet->rssi) {
-		out->rssi = packet->rssi;
-		out->has_rssi = true;
+// Direct encoder for packet records. Fields go out in field number order,
+// exactly as protobuf_c_message_pack() lays them out, so the wire format is
+// unchanged.
+
+#define PROTO_TAG(field, wire_type) ((uint8_t) (((field) << 3) | (wire_type)))
+
+static size_t proto_varint_len(uint64_t value) {
+	size_t len = 1;
+	for (; value >= 0x80; value >>= 7) {
+		len++;
 	}
-	out->payload.data = packet->payload;
-	out->payload.len = len;
+	return len;
 }
 
-static void proto_serialize_mode_ac(struct packet *packet, struct buf *buf) {
-	AdsbPacket packet_out = ADSB_PACKET__INIT;
-	proto_serialize_packet(packet, &packet_out, 2);
-	Adsb msg = ADSB__INIT;
-	msg.mode_ac = &packet_out;
-	proto_wrap_to_buf(&msg, buf);
+static void proto_write_varint(struct buf *buf, uint64_t value) {
+	for (; value >= 0x80; value >>= 7) {
+		buf_chr(buf, buf->length++) = (uint8_t) (value | 0x80);
+	}
+	buf_chr(buf, buf->length++) = (uint8_t) value;
 }
 
-static void proto_serialize_mode_s_short(struct packet *packet, struct buf *buf) {
-	AdsbPacket packet_out = ADSB_PACKET__INIT;
-	proto_serialize_packet(packet, &packet_out, 7);
-	Adsb msg = ADSB__INIT;
-	msg.mode_s_short = &packet_out;
-	proto_wrap_to_buf(&msg, buf);
+static void proto_write_fixed(struct buf *buf, uint64_t value, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		buf_chr(buf, buf->length++) = (uint8_t) (value >> (8 * i));
+	}
 }
 
-static void proto_serialize_mode_s_long(struct packet *packet, struct buf *buf) {
-	AdsbPacket packet_out = ADSB_PACKET__INIT;
-	proto_serialize_packet(packet, &packet_out, 14);
-	Adsb msg = ADSB__INIT;
-	msg.mode_s_long = &packet_out;
-	proto_wrap_to_buf(&msg, buf);
+// Encoded source_id field (tag, length, string) for the last source we
+// serialized.
+static struct source_cache proto_source_cache;
+static uint8_t proto_source_id_field_data[UUID_LEN + 2];
+static struct buf proto_source_id_field = BUF_INIT(proto_source_id_field_data);
+
+static void proto_serialize_packet(struct packet *packet, struct buf *buf, uint8_t field) {
+	if (!source_cache_hit(&proto_source_cache, packet->source)) {
+		const uint8_t *id = source_get(packet->source);
+		size_t id_len = strlen((const char *) id);
+		assert(id_len < UUID_LEN);
+		proto_source_id_field.length = 0;
+		buf_chr(&proto_source_id_field, proto_source_id_field.length++) = PROTO_TAG(1, 2);
+		proto_write_varint(&proto_source_id_field, id_len);
+		memcpy(buf_at(&proto_source_id_field, proto_source_id_field.length), id, id_len);
+		proto_source_id_field.length += id_len;
+	}
+
+	size_t payload_len = packet_payload_len[packet->type];
+	size_t packet_len =
+			proto_source_id_field.length +
+			1 + proto_varint_len(packet->hops) +
+			(packet->mlat_timestamp ? 1 + 8 : 0) +
+			(packet->rssi ? 1 + 4 : 0) +
+			1 + proto_varint_len(payload_len) + payload_len;
+	size_t record_len = 1 + proto_varint_len(packet_len) + packet_len;
+
+	// AdsbStream.msg
+	buf_chr(buf, buf->length++) = PROTO_TAG(1, 2);
+	proto_write_varint(buf, record_len);
+	// Adsb.mode_*
+	buf_chr(buf, buf->length++) = PROTO_TAG(field, 2);
+	proto_write_varint(buf, packet_len);
+	// AdsbPacket
+	memcpy(buf_at(buf, buf->length), proto_source_id_field_data, proto_source_id_field.length);
+	buf->length += proto_source_id_field.length;
+	buf_chr(buf, buf->length++) = PROTO_TAG(2, 0);
+	proto_write_varint(buf, packet->hops);
+	if (packet->mlat_timestamp) {
+		buf_chr(buf, buf->length++) = PROTO_TAG(3, 1);
+		proto_write_fixed(buf, packet->mlat_timestamp, 8);
+	}
+	if (packet->rssi) {
+		buf_chr(buf, buf->length++) = PROTO_TAG(4, 5);
+		proto_write_fixed(buf, packet->rssi, 4);
+	}
+	buf_chr(buf, buf->length++) = PROTO_TAG(5, 2);
+	proto_write_varint(buf, payload_len);
+	memcpy(buf_at(buf, buf->length), packet->payload, payload_len);
+	buf->length += payload_len;
 }
 
 static ssize_t proto_parse_varint(const struct buf *buf, size_t *start) {
@@ -101,7 +144,8 @@ static ssize_t proto_parse_varint(const struct buf *buf, size_t *start) {
 	return -1;
 }
 
-static ssize_t proto_unwrap(const struct buf *wrapper, Adsb **msg) {
+// Returns the length of the wrapped Adsb message, which starts at *start.
+static ssize_t proto_frame(const struct buf *wrapper, size_t *start) {
 	if (wrapper->length < 1) {
 		return -1;
 	}
@@ -111,15 +155,24 @@ static ssize_t proto_unwrap(const struct buf *wrapper, Adsb **msg) {
 		return -1;
 	}
 
-	size_t start = 1;
-	ssize_t len = proto_parse_varint(wrapper, &start);
+	*start = 1;
+	ssize_t len = proto_parse_varint(wrapper, start);
 	if (len == -1) {
 		return -1;
 	}
-	size_t msg_len = (size_t) len;
-	if (start + msg_len > wrapper->length) {
+	if (*start + (size_t) len > wrapper->length) {
+		return -1;
+	}
+	return len;
+}
+
+static ssize_t proto_unwrap(const struct buf *wrapper, Adsb **msg) {
+	size_t start;
+	ssize_t len = proto_frame(wrapper, &start);
+	if (len == -1) {
 		return -1;
 	}
+	size_t msg_len = (size_t) len;
 
 	*msg = adsb__unpack(NULL, msg_len, buf_at(wrapper, start));
 	if (!*msg) {
@@ -145,12 +198,12 @@ static bool proto_parse_header(AdsbHeader *header, struct packet *packet, struct
 	state->rssi_max = header->rssi_max;
 
 	if (!strcmp(header->server_id, (const char *) server_id)) {
-		LOG(packet->source_id, "Attempt to receive proto data from our own server ID (%s); loop!", server_id);
+		LOG(source_get(packet->source), "Attempt to receive proto data from our own server ID (%s); loop!", server_id);
 		return false;
 	}
 
 	state->have_header = true;
-	LOG(packet->source_id, "Connected to server ID: %s", header->server_id);
+	LOG(source_get(packet->source), "Connected to server ID: %s", header->server_id);
 	return true;
 }
 
@@ -167,7 +220,7 @@ static bool proto_parse_packet(AdsbPacket *in, struct packet *packet, struct pro
 		return false;
 	}
 
-	packet->source_id = (uint8_t *) in->source_id;
+	packet->source = source_intern((const uint8_t *) in->source_id);
 	packet->hops = (uint16_t) in->hops;
 	memcpy(packet->payload, in->payload.data, len);
 
@@ -186,6 +239,162 @@ static bool proto_parse_packet(AdsbPacket *in, struct packet *packet, struct pro
 	return true;
 }
 
+// Fast path for packet records in the shape we emit, decoded straight from
+// the receive buffer without protobuf-c's per-message allocations. Returns
+// false for anything else (headers, repeated or oversized fields, groups,
+// odd source IDs) so that protobuf-c makes the call, which keeps the
+// accepted wire format unchanged. Unknown fields are skipped.
+
+static const uint8_t *proto_fast_varint(const uint8_t *ptr, const uint8_t *end, uint64_t *value, size_t max_bytes) {
+	*value = 0;
+	for (size_t i = 0; i < max_bytes && ptr < end; i++, ptr++) {
+		*value |= ((uint64_t) *ptr & 0x7f) << (7 * i);
+		if (!(*ptr & 0x80)) {
+			return ptr + 1;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t proto_fast_fixed(const uint8_t *ptr, size_t bytes) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++) {
+		value |= (uint64_t) ptr[i] << (8 * i);
+	}
+	return value;
+}
+
+static bool proto_fast_packet(const uint8_t *ptr, const uint8_t *end, AdsbPacket *out) {
+	uint32_t seen = 0;
+	while (ptr < end) {
+		uint64_t tag;
+		ptr = proto_fast_varint(ptr, end, &tag, 5);
+		if (!ptr || tag >> 3 == 0 || tag >> 3 > UINT32_MAX) {
+			return false;
+		}
+		uint64_t field = tag >> 3;
+		uint8_t wire_type = tag & 0x7;
+		if (field <= 5) {
+			if (seen & (1U << field)) {
+				return false;
+			}
+			seen |= 1U << field;
+		}
+
+		uint64_t value = 0;
+		const uint8_t *data = ptr;
+		switch (wire_type) {
+			case 0:
+				ptr = proto_fast_varint(ptr, end, &value, 10);
+				if (!ptr) {
+					return false;
+				}
+				break;
+
+			case 1:
+			case 5:
+				value = (wire_type == 1) ? 8 : 4;
+				if ((size_t) (end - ptr) < value) {
+					return false;
+				}
+				ptr += value;
+				break;
+
+			case 2:
+				ptr = proto_fast_varint(ptr, end, &value, 5);
+				if (!ptr || value > (size_t) (end - ptr)) {
+					return false;
+				}
+				data = ptr;
+				ptr += value;
+				break;
+
+			default:
+				return false;
+		}
+
+		switch (field) {
+			case 1:
+				if (wire_type != 2 || value >= UUID_LEN) {
+					return false;
+				}
+				for (size_t i = 0; i < value; i++) {
+					if (data[i] < 32 || data[i] > 126) {
+						return false;
+					}
+				}
+				memcpy(proto_source_id, data, value);
+				proto_source_id[value] = '\0';
+				out->source_id = proto_source_id;
+				break;
+
+			case 2:
+				if (wire_type != 0 || value > UINT32_MAX || ptr - data > 5) {
+					return false;
+				}
+				out->hops = (uint32_t) value;
+				break;
+
+			case 3:
+				if (wire_type != 1) {
+					return false;
+				}
+				out->has_mlat_timestamp = true;
+				out->mlat_timestamp = proto_fast_fixed(data, 8);
+				break;
+
+			case 4:
+				if (wire_type != 5) {
+					return false;
+				}
+				out->has_rssi = true;
+				out->rssi = (uint32_t) proto_fast_fixed(data, 4);
+				break;
+
+			case 5:
+				if (wire_type != 2) {
+					return false;
+				}
+				out->payload.data = (uint8_t *) data;
+				out->payload.len = value;
+				break;
+		}
+	}
+	// source_id, hops and payload are required
+	return (seen & 0x26) == 0x26;
+}
+
+static bool proto_fast_adsb(const uint8_t *ptr, size_t len, AdsbPacket *out, enum packet_type *type) {
+	const uint8_t *end = ptr + len;
+	uint64_t tag, packet_len;
+	ptr = proto_fast_varint(ptr, end, &tag, 1);
+	if (!ptr || (tag & 0x7) != 2) {
+		return false;
+	}
+	switch (tag >> 3) {
+		case 2:
+			*type = PACKET_TYPE_MODE_AC;
+			break;
+
+		case 3:
+			*type = PACKET_TYPE_MODE_S_SHORT;
+			break;
+
+		case 4:
+			*type = PACKET_TYPE_MODE_S_LONG;
+			break;
+
+		default:
+			return false;
+	}
+	ptr = proto_fast_varint(ptr, end, &packet_len, 5);
+	// Exactly one record, and nothing after it
+	if (!ptr || packet_len != (size_t) (end - ptr)) {
+		return false;
+	}
+	return proto_fast_packet(ptr, end, out);
+}
+
 void proto_init() {
 	AdsbHeader header = ADSB_HEADER__INIT;
 	header.magic = PROTO_MAGIC;
@@ -201,18 +410,38 @@ void proto_init() {
 	proto_wrap_to_buf(&msg, &proto_hello_buf);
 }
 
-void proto_cleanup() {
-	if (proto_prev) {
-		adsb__free_unpacked(proto_prev, NULL);
+uint8_t proto_score(const struct buf *buf) {
+	// Field ID 1, encoding type 2 (length-prefixed blob), then a varint length
+	if (buf_chr(buf, 0) != ((1 << 3) | 2)) {
+		return 0;
+	}
+	uint64_t len = 0;
+	for (size_t i = 1; i < buf->length && i <= 10; i++) {
+		len |= (uint64_t) (buf_chr(buf, i) & 0x7f) << (7 * (i - 1));
+		if (!(buf_chr(buf, i) & 0x80)) {
+			return (len && len <= buf->size) ? 80 : 0;
+		}
 	}
+	return 50;
 }
 
 bool proto_parse(struct buf *buf, struct packet *packet, void *state_in) {
 	struct proto_parser_state *state = (struct proto_parser_state *) state_in;
 
-	if (proto_prev) {
-		adsb__free_unpacked(proto_prev, NULL);
-		proto_prev = NULL;
+	size_t start;
+	ssize_t msg_len = proto_frame(buf, &start);
+	if (msg_len == -1) {
+		return false;
+	}
+	AdsbPacket fast = ADSB_PACKET__INIT;
+	enum packet_type type;
+	if (proto_fast_adsb(buf_at(buf, start), (size_t) msg_len, &fast, &type)) {
+		if (!proto_parse_packet(&fast, packet, state, packet_payload_len[type])) {
+			return false;
+		}
+		packet->type = type;
+		buf_consume(buf, start + (size_t) msg_len);
+		return true;
 	}
 
 	Adsb *msg;
@@ -251,7 +480,7 @@ bool proto_parse(struct buf *buf, struct packet *packet, void *state_in) {
 		return false;
 	}
 
-	proto_prev = msg;
+	adsb__free_unpacked(msg, NULL);
 	buf_consume(buf, (size_t) len);
 	return true;
 }
@@ -262,16 +491,16 @@ void proto_serialize(struct packet *packet, struct buf *buf) {
 			break;
 
 		case PACKET_TYPE_MODE_AC:
-			proto_serialize_mode_ac(packet, buf);
+			proto_serialize_packet(packet, buf, 2);
 			break;
 
 
 		case PACKET_TYPE_MODE_S_SHORT:
-			proto_serialize_mode_s_short(packet, buf);
+			proto_serialize_packet(packet, buf, 3);
 			break;
 
 		case PACKET_TYPE_MODE_S_LONG:
-			proto_serialize_mode_s_long(packet, buf);
+			proto_serialize_packet(packet, buf, 4);
 			break;
 	}
 }
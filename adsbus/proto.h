@@ -1,12 +1,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct buf;
 struct packet;
 
 void proto_init(void);
-void proto_cleanup(void);
+uint8_t __attribute__ ((warn_unused_result)) proto_score(const struct buf *);
 bool __attribute__ ((warn_unused_result)) proto_parse(struct buf *, struct packet *, void *);
 void proto_serialize(struct packet *, struct buf *);
 void proto_hello(struct buf **);
@@ -11,7 +11,8 @@
 
 #include "rand.h"
 
-static struct buf rand_buf = BUF_INIT;
+static uint8_t rand_data[BUF_LEN_MAX];
+static struct buf rand_buf = BUF_INIT(rand_data);
 static int rand_fd;
 
 void rand_init() {
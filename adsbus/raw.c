@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 
 #include "buf.h"
 #include "hex.h"
@@ -19,9 +20,7 @@ static bool raw_parse_packet(struct buf *buf, struct packet *packet, enum packet
 	size_t total_len = overlay_start + sizeof(*overlay);
 
 	if (((buf->length < total_len - 1 || overlay->cr_lf != '\n') &&
-			 (buf->length < total_len || overlay->cr_lf != '\r' || overlay->lf != '\n')) ||
-			buf_chr(buf, 0) != '*' ||
-			overlay->semicolon != ';') {
+			 (buf->length < total_len || overlay->cr_lf != '\r' || overlay->lf != '\n'))) {
 		return false;
 	}
 	if (!hex_to_bin(packet->payload, buf_at(buf, 1), payload_bytes)) {
@@ -36,11 +35,35 @@ void raw_init() {
 	assert(1 + PACKET_PAYLOAD_LEN_MAX + sizeof(struct raw_overlay) < BUF_LEN_MAX);
 }
 
+uint8_t raw_score(const struct buf *buf) {
+	if (buf_chr(buf, 0) != '*') {
+		return 0;
+	}
+	int term = buf_star_terminator(buf);
+	if (term < 0) {
+		return 10;
+	}
+	if (term == 0) {
+		return 50;
+	}
+	return (term == '\r' || term == '\n') ? 90 : 10;
+}
+
 bool raw_parse(struct buf *buf, struct packet *packet, void __attribute__((unused)) *state_in) {
-	return (
-			raw_parse_packet(buf, packet, PACKET_TYPE_MODE_AC) ||
-			raw_parse_packet(buf, packet, PACKET_TYPE_MODE_S_SHORT) ||
-			raw_parse_packet(buf, packet, PACKET_TYPE_MODE_S_LONG));
+	// The first ';' ends the payload, and its position gives the type.
+	if (buf->length < 2 || buf_chr(buf, 0) != '*') {
+		return false;
+	}
+	size_t scan_len = buf->length - 1 < PACKET_PAYLOAD_LEN_MAX * 2 + 1 ? buf->length - 1 : PACKET_PAYLOAD_LEN_MAX * 2 + 1;
+	const uint8_t *semicolon = memchr(buf_at(buf, 1), ';', scan_len);
+	if (!semicolon) {
+		return false;
+	}
+	enum packet_type type = packet_type_from_text_len((size_t) (semicolon - buf_at(buf, 1)));
+	if (type == PACKET_TYPE_NONE) {
+		return false;
+	}
+	return raw_parse_packet(buf, packet, type);
 }
 
 void raw_serialize(struct packet *packet, struct buf *buf) {
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct buf;
 struct packet;
 
 void raw_init(void);
+uint8_t __attribute__ ((warn_unused_result)) raw_score(const struct buf *);
 bool __attribute__ ((warn_unused_result)) raw_parse(struct buf *, struct packet *, void *);
 void raw_serialize(struct packet *, struct buf *);
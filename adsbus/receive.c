@@ -1,13 +1,21 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <sys/types.h>
 
+#include "aircraft.h"
 #include "airspy_adsb.h"
 #include "beast.h"
 #include "buf.h"
+#include "compact.h"
+#include "crc.h"
+#include "dedup.h"
 #include "flow.h"
 #include "json.h"
 #include "log.h"
@@ -17,6 +25,7 @@
 #include "raw.h"
 #include "socket.h"
 #include "send.h"
+#include "source.h"
 #include "uuid.h"
 
 #include "receive.h"
@@ -29,10 +38,17 @@ struct receive {
 	struct stat stat;
 	struct peer *on_close;
 	uint8_t id[UUID_LEN];
+	uint32_t source;
 	struct buf buf;
 	char parser_state[PARSER_STATE_LEN];
 	parser_wrapper parser_wrapper;
 	parser parser;
+	size_t (*resync)(const struct buf *);
+	void (*parser_cleanup)(void *);
+	uint64_t resync_count;
+	uint64_t resync_bytes;
+	uint64_t crc_counts[NUM_CRC_RESULTS];
+	bool edge_triggered;
 	struct list_head receive_list;
 };
 static struct list_head receive_head = LIST_HEAD_INIT(receive_head);
@@ -49,34 +65,61 @@ static struct flow _receive_flow = {
 };
 struct flow *receive_flow = &_receive_flow;
 
+// Signature scores are percentages. 0 means the parser cannot possibly
+// accept this buffer, so autodetection never runs it.
 static struct parser {
 	char *name;
 	parser parse;
+	uint8_t (*score)(const struct buf *);
+	size_t (*resync)(const struct buf *);
+	void (*cleanup)(void *);
 } parsers[] = {
 	{
 		.name = "airspy_adsb",
 		.parse = airspy_adsb_parse,
+		.score = airspy_adsb_score,
+		.resync = buf_resync_star_line,
 	},
 	{
 		.name = "beast",
 		.parse = beast_parse,
+		.score = beast_score,
+		.resync = beast_resync,
+	},
+	{
+		.name = "compact",
+		.parse = compact_parse,
+		.score = compact_score,
+		.cleanup = compact_parser_cleanup,
 	},
 	{
 		.name = "json",
 		.parse = json_parse,
+		.score = json_score,
+		.resync = json_resync,
 	},
 	{
 		.name = "proto",
 		.parse = proto_parse,
+		.score = proto_score,
 	},
 	{
 		.name = "raw",
 		.parse = raw_parse,
+		.score = raw_score,
+		.resync = buf_resync_star_line,
 	},
 };
 #define NUM_PARSERS (sizeof(parsers) / sizeof(*parsers))
 
 static uint32_t receive_max_hops = 10;
+static size_t receive_buf_len = 64 * 1024;
+// Setting either budget switches non-blocking inputs to edge-triggered
+// draining, capped per loop iteration.
+static size_t receive_budget_bytes = 0;
+static size_t receive_budget_packets = 0;
+// Only one input parses at a time, and it flushes before returning.
+static struct packet_batch receive_batch;
 
 static bool receive_parse_wrapper(struct receive *receive, struct packet *packet) {
 	return receive->parser(&receive->buf, packet, receive->parser_state);
@@ -86,63 +129,173 @@ static bool receive_autodetect_parse(struct receive *receive, struct packet *pac
 	struct buf *buf = &receive->buf;
 	void *state = receive->parser_state;
 
+	uint8_t scores[NUM_PARSERS];
+	size_t candidates = 0;
+	for (size_t i = 0; i < NUM_PARSERS; i++) {
+		scores[i] = parsers[i].score(buf);
+		if (scores[i]) {
+			candidates++;
+		}
+	}
+
 	// We don't trust parsers not to scribble over the packet.
 	struct packet orig_packet;
-	memcpy(&orig_packet, packet, sizeof(orig_packet));
+	if (candidates > 1) {
+		memcpy(&orig_packet, packet, sizeof(orig_packet));
+	}
 
-	for (size_t i = 0; i < NUM_PARSERS; i++) {
-		if (parsers[i].parse(buf, packet, state)) {
-			LOG(receive->id, "Detected input format: %s", parsers[i].name);
+	// Best score first; ties go to table order.
+	while (candidates--) {
+		size_t best = 0;
+		for (size_t i = 1; i < NUM_PARSERS; i++) {
+			if (scores[i] > scores[best]) {
+				best = i;
+			}
+		}
+		uint8_t score = scores[best];
+		scores[best] = 0;
+		if (parsers[best].parse(buf, packet, state)) {
+			LOG(receive->id, "Detected input format: %s (signature confidence %u%%)", parsers[best].name, score);
 			receive->parser_wrapper = receive_parse_wrapper;
-			receive->parser = parsers[i].parse;
+			receive->parser = parsers[best].parse;
+			receive->resync = parsers[best].resync;
+			receive->parser_cleanup = parsers[best].cleanup;
 			return true;
 		}
-		if (i < NUM_PARSERS - 1) {
+		if (candidates) {
 			memcpy(packet, &orig_packet, sizeof(*packet));
 		}
 	}
 	return false;
 }
 
+static void receive_log_counters(struct receive *receive) {
+	if (receive->resync_count) {
+		LOG(receive->id, "Resynchronized %" PRIu64 " times, skipping %" PRIu64 " bytes", receive->resync_count, receive->resync_bytes);
+	}
+	if (crc_enabled()) {
+		LOG(receive->id, "Parity: %" PRIu64 " good, %" PRIu64 " corrected, %" PRIu64 " bad, %" PRIu64 " unchecked",
+				receive->crc_counts[CRC_GOOD], receive->crc_counts[CRC_CORRECTED], receive->crc_counts[CRC_BAD], receive->crc_counts[CRC_UNCHECKED]);
+	}
+}
+
 static void receive_del(struct receive *receive) {
+	receive_log_counters(receive);
 	LOG(receive->id, "Connection closed");
 	peer_count_in--;
 	peer_close(&receive->peer);
 	list_del(&receive->receive_list);
 	peer_call(receive->on_close);
+	if (receive->parser_cleanup) {
+		receive->parser_cleanup(receive->parser_state);
+	}
+	source_unref(receive->source);
+	buf_free(&receive->buf);
 	free(receive);
 }
 
-static void receive_read(struct peer *peer) {
-	struct receive *receive = container_of(peer, struct receive, peer);
+static bool receive_resync(struct receive *receive) {
+	if (!receive->resync) {
+		return false;
+	}
+	size_t skip = receive->resync(&receive->buf);
+	if (!skip) {
+		return false;
+	}
+	if (!receive->resync_count++) {
+		LOG(receive->id, "Input stream corrupt; resynchronizing (further resyncs are counted and logged at close)");
+	}
+	receive->resync_bytes += skip;
+	buf_consume(&receive->buf, skip);
+	return true;
+}
 
-	if (buf_fill(&receive->buf, receive->peer.fd) <= 0) {
-		receive_del(receive);
-		return;
+static void receive_batch_flush() {
+	if (receive_batch.count) {
+		send_write_batch(&receive_batch);
+		receive_batch.count = 0;
 	}
+	source_collect();
+}
+
+static uint64_t receive_get_time_ms() {
+	struct timespec now;
+	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
+	return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
 
+static bool receive_parse(struct receive *receive, size_t *packets) {
+	uint64_t now_ms = (crc_enabled() || dedup_enabled() || aircraft_enabled()) ? receive_get_time_ms() : 0;
 	while (receive->buf.length) {
-		struct packet packet = {
-			.source_id = receive->id,
+		struct packet *packet = &receive_batch.packets[receive_batch.count];
+		*packet = (struct packet) {
+			.source = receive->source,
 			.input_stat = &receive->stat,
 		};
-		if (!receive->parser_wrapper(receive, &packet)) {
+		if (!receive->parser_wrapper(receive, packet)) {
+			if (receive_resync(receive)) {
+				continue;
+			}
 			break;
 		}
-		if (packet.type == PACKET_TYPE_NONE) {
+		if (packet->type == PACKET_TYPE_NONE) {
+			continue;
+		}
+		(*packets)++;
+		if (++packet->hops > receive_max_hops) {
+			LOG(receive->id, "Packet exceeded hop limit (%u > %u); dropping. You may have a loop in your configuration.", packet->hops, receive_max_hops);
 			continue;
 		}
-		if (++packet.hops > receive_max_hops) {
-			LOG(receive->id, "Packet exceeded hop limit (%u > %u); dropping. You may have a loop in your configuration.", packet.hops, receive_max_hops);
+		if (crc_enabled() && !crc_filter(packet, now_ms, receive->crc_counts)) {
 			continue;
 		}
-		send_write(&packet);
+		receive_batch.duplicate[receive_batch.count] = dedup_enabled() && dedup_check(packet, now_ms);
+		if (aircraft_enabled() && !receive_batch.duplicate[receive_batch.count]) {
+			aircraft_update(packet, now_ms);
+		}
+		if (++receive_batch.count == PACKET_BATCH_MAX) {
+			receive_batch_flush();
+		}
 	}
+	receive_batch_flush();
 
-	if (receive->buf.length == BUF_LEN_MAX) {
+	if (receive->buf.length == receive->buf.size) {
 		LOG(receive->id, "Input buffer overrun. This probably means that adsbus doesn't understand the protocol that this source is speaking.");
 		receive_del(receive);
-		return;
+		return false;
+	}
+	return true;
+}
+
+static bool receive_over_budget(size_t bytes, size_t packets) {
+	return ((receive_budget_bytes && bytes >= receive_budget_bytes) ||
+			(receive_budget_packets && packets >= receive_budget_packets));
+}
+
+static void receive_read(struct peer *peer) {
+	struct receive *receive = container_of(peer, struct receive, peer);
+
+	size_t bytes = 0, packets = 0;
+	do {
+		ssize_t in = buf_fill(&receive->buf, receive->peer.fd);
+		if (in < 0 && receive->edge_triggered && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// Drained; wait for the next edge
+			return;
+		}
+		if (in <= 0) {
+			receive_del(receive);
+			return;
+		}
+		bytes += (size_t) in;
+		if (!receive_parse(receive, &packets)) {
+			return;
+		}
+	} while (receive->edge_triggered && !receive_over_budget(bytes, packets));
+
+	if (receive->edge_triggered) {
+		// Out of budget with data possibly left; let everyone else have a turn
+		// first, and come back without waiting for an edge that won't come.
+		peer_ready_add(peer);
 	}
 }
 
@@ -156,27 +309,54 @@ static void receive_new(int fd, void __attribute__((unused)) *passthrough, struc
 	receive->peer.event_handler = receive_read;
 	receive->on_close = on_close;
 	uuid_gen(receive->id);
-	buf_init(&receive->buf);
+	receive->source = source_intern(receive->id);
+	source_ref(receive->source);
+	buf_alloc(&receive->buf, receive_buf_len);
 	memset(receive->parser_state, 0, PARSER_STATE_LEN);
 	receive->parser_wrapper = receive_autodetect_parse;
+	receive->resync = NULL;
+	receive->parser_cleanup = NULL;
+	receive->resync_count = receive->resync_bytes = 0;
+	memset(receive->crc_counts, 0, sizeof(receive->crc_counts));
 	assert(!fstat(fd, &receive->stat));
 
+	int flags = fcntl(fd, F_GETFL);
+	assert(flags >= 0);
+	// Draining to EAGAIN needs a non-blocking fd, and regular files are
+	// polled every iteration anyway.
+	receive->edge_triggered = (receive_budget_bytes || receive_budget_packets) && (flags & O_NONBLOCK) && !S_ISREG(receive->stat.st_mode);
+
 	list_add(&receive->receive_list, &receive_head);
 
-	peer_epoll_add(&receive->peer, EPOLLIN);
+	peer_epoll_add(&receive->peer, EPOLLIN | (receive->edge_triggered ? EPOLLET : 0));
 
 	LOG(receive->id, "New receive connection");
 }
 
+static uint64_t receive_getenv_uint(const char *name, uint64_t def, uint64_t min, uint64_t max) {
+	char *val = getenv(name);
+	if (!val) {
+		return def;
+	}
+	char *end_ptr;
+	unsigned long long val_ull = strtoull(val, &end_ptr, 10);
+	assert(val[0] != '\0');
+	assert(end_ptr[0] == '\0');
+	assert(val_ull >= min && val_ull <= max);
+	return val_ull;
+}
+
 void receive_init() {
-	char *max_hops = getenv("ADSBUS_MAX_HOPS");
-	if (max_hops) {
-		char *end_ptr;
-		unsigned long max_hops_ul = strtoul(max_hops, &end_ptr, 10);
-		assert(max_hops[0] != '\0');
-		assert(end_ptr[0] == '\0');
-		assert(max_hops_ul <= UINT32_MAX);
-		receive_max_hops = (uint32_t) max_hops_ul;
+	receive_max_hops = (uint32_t) receive_getenv_uint("ADSBUS_MAX_HOPS", receive_max_hops, 0, UINT32_MAX);
+	receive_buf_len = (size_t) receive_getenv_uint("ADSBUS_RECEIVE_BUFFER", receive_buf_len, BUF_LEN_MAX, SIZE_MAX / 2);
+	receive_budget_bytes = (size_t) receive_getenv_uint("ADSBUS_RECEIVE_BUDGET_BYTES", receive_budget_bytes, 0, SIZE_MAX);
+	receive_budget_packets = (size_t) receive_getenv_uint("ADSBUS_RECEIVE_BUDGET_PACKETS", receive_budget_packets, 0, SIZE_MAX);
+}
+
+void receive_log_all_counters() {
+	struct receive *iter;
+	list_for_each_entry(iter, &receive_head, receive_list) {
+		receive_log_counters(iter);
 	}
 }
 
@@ -7,4 +7,5 @@ struct flow;
 void receive_init(void);
 void receive_cleanup(void);
 void receive_print_usage(void);
+void receive_log_all_counters(void);
 extern struct flow *receive_flow;
@@ -0,0 +1,58 @@
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+struct ring {
+	size_t elem_size;
+	size_t mask;
+	uint8_t *elems;
+	// Producer and consumer indexes on separate cache lines
+	alignas(64) atomic_size_t head;
+	alignas(64) atomic_size_t tail;
+};
+
+struct ring *ring_new(size_t elem_size, size_t num_elems) {
+	// num_elems must be a power of two
+	assert(num_elems && !(num_elems & (num_elems - 1)));
+	struct ring *ring = aligned_alloc(alignof(struct ring), sizeof(*ring));
+	assert(ring);
+	ring->elem_size = elem_size;
+	ring->mask = num_elems - 1;
+	ring->elems = malloc(elem_size * num_elems);
+	assert(ring->elems);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return ring;
+}
+
+void ring_del(struct ring *ring) {
+	free(ring->elems);
+	free(ring);
+}
+
+bool ring_push(struct ring *ring, const void *elem) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail > ring->mask) {
+		return false;
+	}
+	memcpy(&ring->elems[(head & ring->mask) * ring->elem_size], elem, ring->elem_size);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+bool ring_pop(struct ring *ring, void *elem) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	memcpy(elem, &ring->elems[(tail & ring->mask) * ring->elem_size], ring->elem_size);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
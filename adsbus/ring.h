@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free ring of fixed-size elements: one producer thread, one consumer
+// thread.
+struct ring;
+
+struct ring *ring_new(size_t, size_t);
+void ring_del(struct ring *);
+bool __attribute__ ((warn_unused_result)) ring_push(struct ring *, const void *);
+bool __attribute__ ((warn_unused_result)) ring_pop(struct ring *, void *);
@@ -1,17 +1,36 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "airspy_adsb.h"
 #include "beast.h"
 #include "buf.h"
+#include "compact.h"
+#include "dedup.h"
 #include "flow.h"
+#include "icao_table.h"
 #include "json.h"
 #include "log.h"
 #include "opts.h"
@@ -19,21 +38,125 @@
 #include "peer.h"
 #include "proto.h"
 #include "raw.h"
+#include "receive.h"
+#include "ring.h"
+#include "server.h"
 #include "socket.h"
 #include "stats.h"
 #include "uuid.h"
 
 #include "send.h"
 
+// Serialized bytes shared by every client of a serializer. Clients queue
+// (slab, start, end) ranges instead of copies.
+struct send_slab {
+	atomic_uint ref_count;
+	size_t length;
+	uint8_t data[];
+};
+
+struct send_range {
+	struct send_slab *slab;
+	size_t start;
+	size_t end;
+	uint64_t packets;
+	uint64_t queued_ms;
+};
+
+// What to do when a client's queue would exceed max_queue
+enum send_policy {
+	SEND_POLICY_DISCONNECT,
+	SEND_POLICY_DROP_OLDEST,
+	SEND_POLICY_DROP_NEWEST,
+	NUM_SEND_POLICIES,
+};
+
+static const char *send_policy_names[] = {
+	[SEND_POLICY_DISCONNECT] = "disconnect",
+	[SEND_POLICY_DROP_OLDEST] = "drop_oldest",
+	[SEND_POLICY_DROP_NEWEST] = "drop_newest",
+};
+
+struct send_output {
+	struct serializer *serializer;
+	uint32_t flush_ms;
+	bool zerocopy;
+	enum send_policy policy;
+	size_t max_queue;
+	uint64_t max_lag_ms;
+	// Filters, applied before serialization
+	bool dedup;
+	uint64_t icao_interval_ms;
+	struct icao_table *icao_table;
+	uint32_t sample_n;
+	uint64_t sample_count;
+	size_t num_sends;
+	// Per packet of the current batch
+	bool pass[PACKET_BATCH_MAX];
+	size_t pass_count;
+	struct list_head send_output_list;
+};
+
+// Written only by the thread that owns the send; read by the main thread
+// when dumping statistics.
+struct send_counters {
+	_Atomic uint64_t queued_bytes;
+	_Atomic uint64_t max_queued_bytes;
+	_Atomic uint64_t dropped_packets;
+	_Atomic uint64_t dropped_bytes;
+	_Atomic uint64_t max_lag_ms;
+	_Atomic uint64_t zerocopy_sends;
+	_Atomic uint64_t zerocopy_copied;
+};
+
+// A slab the kernel may still be reading from, until the MSG_ZEROCOPY
+// notification for seq arrives.
+struct send_pin {
+	struct send_slab *slab;
+	uint32_t seq;
+};
+
 struct send {
 	struct peer peer;
+	struct peer flush_peer;
 	struct stat stat;
 	struct peer *on_close;
 	uint8_t id[UUID_LEN];
-	struct serializer *serializer;
+	struct send_output *output;
+	struct send_thread *thread;
+	struct send_range *queue;
+	size_t queue_size;
+	size_t queue_start;
+	size_t queue_count;
+	size_t queue_length;
+	bool queue_armed;
+	bool queue_partial;
+	bool blocking;
+	bool pending;
+	bool flush_armed;
+	bool overflow;
+	bool lagging;
+	bool zerocopy;
+	uint32_t zerocopy_seq;
+	struct send_pin *pins;
+	size_t pins_size;
+	size_t pins_start;
+	size_t pins_count;
+	struct send_counters counters;
 	struct list_head send_list;
+	struct list_head send_pending_list;
+	struct list_head send_all_list;
 };
 
+#define SEND_QUEUE_LEN_DEFAULT (1024 * 1024)
+#define SEND_SLAB_LEN (64 * 1024)
+#define SEND_IOV_MAX 64
+// Below this, page pinning and notifications cost more than the copy
+#define SEND_ZEROCOPY_MIN (16 * 1024)
+#define SEND_RING_LEN 4096
+#define SEND_THREADS_MAX 64
+#define SEND_THREAD_MAX_EVENTS 64
+
 static void send_new(int, void *, struct peer *);
 
 static struct flow _send_flow = {
@@ -48,13 +171,32 @@ struct flow *send_flow = &_send_flow;
 
 static char log_module = 'S';
 
+static struct list_head send_output_head = LIST_HEAD_INIT(send_output_head);
+static struct list_head send_pending_head = LIST_HEAD_INIT(send_pending_head);
+static struct list_head send_all_head = LIST_HEAD_INIT(send_all_head);
+static struct peer send_pending_peer;
+static struct peer send_stats_peer;
+static opts_group send_opts;
+
 typedef void (*serialize)(struct packet *, struct buf *);
 typedef void (*hello)(struct buf **);
+// Serializers with a restart hook keep state across records, so every client
+// needs every record: new clients call restart, and outputs can't drop or
+// decimate.
+typedef void (*restart)(void);
 static struct serializer {
 	char *name;
 	serialize serialize;
 	hello hello;
+	restart restart;
+	// Keeps shared state over every packet (e.g. counts), so outputs can't
+	// filter what it sees.
+	bool unfiltered;
+	struct send_slab *slab;
 	struct list_head send_head;
+	// Per packet of the current batch: does any output want it?
+	bool wanted[PACKET_BATCH_MAX];
+	size_t wanted_count;
 } serializers[] = {
 	{
 		.name = "airspy_adsb",
@@ -66,6 +208,12 @@ static struct serializer {
 		.serialize = beast_serialize,
 		.hello = NULL,
 	},
+	{
+		.name = "compact",
+		.serialize = compact_serialize,
+		.hello = compact_hello,
+		.restart = compact_restart,
+	},
 	{
 		.name = "json",
 		.serialize = json_serialize,
@@ -85,43 +233,1000 @@ static struct serializer {
 		.name = "stats",
 		.serialize = stats_serialize,
 		.hello = NULL,
+		.unfiltered = true,
 	},
 };
 #define NUM_SERIALIZERS (sizeof(serializers) / sizeof(*serializers))
 
+// Sockets can be sharded across worker threads (--send-threads). The main
+// thread still parses and serializes; it publishes (slab, range) batches to
+// each worker over a ring, and workers hand dead sends back for cleanup.
+enum send_msg_type {
+	SEND_MSG_ADD,
+	SEND_MSG_DATA,
+	SEND_MSG_STOP,
+};
+
+struct send_msg {
+	enum send_msg_type type;
+	struct send *send;
+	size_t serializer;
+	struct send_output *output;
+	struct send_slab *slab;
+	size_t start;
+	size_t length;
+	uint64_t packets;
+	uint64_t queued_ms;
+	dev_t st_dev;
+	ino_t st_ino;
+	bool can_wait;
+};
+
+struct send_thread {
+	pthread_t thread;
+	int epoll_fd;
+	struct peer wake_peer;
+	int space_fd;
+	atomic_bool producer_waiting;
+	struct ring *ring;
+
+	// Worker thread only
+	bool running;
+	struct list_head send_head[NUM_SERIALIZERS];
+	struct list_head pending_head;
+	struct list_head dead_head;
+
+	// Main thread only
+	size_t num_sends;
+	size_t send_count[NUM_SERIALIZERS];
+	struct send_msg staged[NUM_SERIALIZERS];
+	bool dirty;
+};
+
+static struct send_thread *send_threads = NULL;
+static size_t send_num_threads = 0;
+static struct peer send_reap_peer;
+static pthread_mutex_t send_reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head send_reap_head = LIST_HEAD_INIT(send_reap_head);
+
+typedef bool (*send_option_handler)(struct send_output *, const char *);
+static bool send_set_threads(const char *arg) {
+	char *end;
+	unsigned long val = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || val > SEND_THREADS_MAX) {
+		return false;
+	}
+	send_num_threads = (size_t) val;
+	return true;
+}
+
+static bool send_option_dedup(struct send_output *, const char *);
+static bool send_option_flush_ms(struct send_output *, const char *);
+static bool send_option_policy(struct send_output *, const char *);
+static bool send_option_max_queue(struct send_output *, const char *);
+static bool send_option_max_lag_ms(struct send_output *, const char *);
+static bool send_option_max_per_icao_hz(struct send_output *, const char *);
+static bool send_option_zerocopy(struct send_output *, const char *);
+static bool send_option_sample(struct send_output *, const char *);
+static struct send_option {
+	char *name;
+	char *arg_help;
+	send_option_handler handler;
+} send_options[] = {
+	{
+		.name = "dedup",
+		.arg_help = "on|off",
+		.handler = send_option_dedup,
+	},
+	{
+		.name = "flush_ms",
+		.arg_help = "MS",
+		.handler = send_option_flush_ms,
+	},
+	{
+		.name = "policy",
+		.arg_help = "disconnect|drop_oldest|drop_newest",
+		.handler = send_option_policy,
+	},
+	{
+		.name = "max_queue",
+		.arg_help = "BYTES",
+		.handler = send_option_max_queue,
+	},
+	{
+		.name = "max_lag_ms",
+		.arg_help = "MS",
+		.handler = send_option_max_lag_ms,
+	},
+	{
+		.name = "max_per_icao_hz",
+		.arg_help = "HZ",
+		.handler = send_option_max_per_icao_hz,
+	},
+	{
+		.name = "sample",
+		.arg_help = "1/N",
+		.handler = send_option_sample,
+	},
+	{
+		.name = "zerocopy",
+		.arg_help = "on|off",
+		.handler = send_option_zerocopy,
+	},
+};
+#define NUM_SEND_OPTIONS (sizeof(send_options) / sizeof(*send_options))
+
+static uint64_t send_get_time_ms() {
+	struct timespec now;
+	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
+	return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+static void send_counter_add(_Atomic uint64_t *counter, uint64_t val) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + val, memory_order_relaxed);
+}
+
+static void send_counter_max(_Atomic uint64_t *counter, uint64_t val) {
+	if (val > atomic_load_explicit(counter, memory_order_relaxed)) {
+		atomic_store_explicit(counter, val, memory_order_relaxed);
+	}
+}
+
+static bool send_output_filtered(const struct send_output *output) {
+	return output->dedup || output->icao_interval_ms || output->sample_n > 1;
+}
+
+static void send_slab_get(struct send_slab *slab) {
+	atomic_fetch_add_explicit(&slab->ref_count, 1, memory_order_relaxed);
+}
+
+static void send_slab_put(struct send_slab *slab) {
+	if (atomic_fetch_sub_explicit(&slab->ref_count, 1, memory_order_acq_rel) == 1) {
+		free(slab);
+	}
+}
+
+static struct send_slab *send_slab_append(struct serializer *serializer, struct buf *buf, size_t *start) {
+	struct send_slab *slab = serializer->slab;
+	if (slab && atomic_load_explicit(&slab->ref_count, memory_order_acquire) == 1) {
+		// Only the serializer still holds it; reuse from the top
+		slab->length = 0;
+	}
+	if (!slab || slab->length + buf->length > SEND_SLAB_LEN) {
+		if (slab) {
+			send_slab_put(slab);
+		}
+		slab = serializer->slab = malloc(sizeof(*slab) + SEND_SLAB_LEN);
+		assert(slab);
+		atomic_init(&slab->ref_count, 1);
+		slab->length = 0;
+	}
+	*start = slab->length;
+	memcpy(&slab->data[slab->length], buf_at(buf, 0), buf->length);
+	slab->length += buf->length;
+	return slab;
+}
+
+static void send_thread_epoll(struct send_thread *thread, int op, struct peer *peer, uint32_t events) {
+	struct epoll_event ev = {
+		.events = events,
+		.data = {
+			.ptr = peer,
+		},
+	};
+	assert(!epoll_ctl(thread->epoll_fd, op, peer->fd, &ev));
+}
+
+static void send_thread_close(struct send_thread *thread, struct peer *peer) {
+	if (peer->fd == -1) {
+		return;
+	}
+	send_thread_epoll(thread, EPOLL_CTL_DEL, peer, 0);
+	assert(!close(peer->fd));
+	peer->fd = -1;
+}
+
+static void send_thread_release(struct send *send) {
+	// Worker side of send_del(): stop using it, and let the main thread finish
+	// the job once this batch of events is done.
+	struct send_thread *thread = send->thread;
+	send_thread_close(thread, &send->peer);
+	send_thread_close(thread, &send->flush_peer);
+	list_del(&send->send_list);
+	list_add(&send->send_list, &thread->dead_head);
+	if (send->pending) {
+		list_del(&send->send_pending_list);
+		send->pending = false;
+	}
+}
+
+static void send_log_counters(struct send *send) {
+	struct send_counters *counters = &send->counters;
+	LOG(send->id, "Queued %" PRIu64 " bytes (max %" PRIu64 "), dropped %" PRIu64 " packets (%" PRIu64 " bytes), max lag %" PRIu64 " ms",
+			atomic_load_explicit(&counters->queued_bytes, memory_order_relaxed),
+			atomic_load_explicit(&counters->max_queued_bytes, memory_order_relaxed),
+			atomic_load_explicit(&counters->dropped_packets, memory_order_relaxed),
+			atomic_load_explicit(&counters->dropped_bytes, memory_order_relaxed),
+			atomic_load_explicit(&counters->max_lag_ms, memory_order_relaxed));
+	if (send->zerocopy) {
+		LOG(send->id, "Zerocopy: %" PRIu64 " sends, %" PRIu64 " completed by copying",
+				atomic_load_explicit(&counters->zerocopy_sends, memory_order_relaxed),
+				atomic_load_explicit(&counters->zerocopy_copied, memory_order_relaxed));
+	}
+}
+
+static void send_pin_release(struct send *send, uint32_t seq) {
+	// TCP completes zerocopy sends in order
+	while (send->pins_count && (int32_t) (seq - send->pins[send->pins_start].seq) >= 0) {
+		send_slab_put(send->pins[send->pins_start].slab);
+		send->pins_start++;
+		send->pins_count--;
+	}
+	if (!send->pins_count) {
+		send->pins_start = 0;
+	}
+}
+
+static void send_pin_add(struct send *send, struct send_slab *slab, uint32_t seq) {
+	if (send->pins_count) {
+		struct send_pin *last = &send->pins[send->pins_start + send->pins_count - 1];
+		if (last->slab == slab) {
+			last->seq = seq;
+			return;
+		}
+	}
+	if (send->pins_start && send->pins_start + send->pins_count == send->pins_size) {
+		memmove(send->pins, &send->pins[send->pins_start], send->pins_count * sizeof(*send->pins));
+		send->pins_start = 0;
+	}
+	if (send->pins_count == send->pins_size) {
+		send->pins_size = send->pins_size ? send->pins_size * 2 : 16;
+		send->pins = realloc(send->pins, send->pins_size * sizeof(*send->pins));
+		assert(send->pins);
+	}
+	struct send_pin *pin = &send->pins[send->pins_start + send->pins_count++];
+	pin->slab = slab;
+	pin->seq = seq;
+	send_slab_get(slab);
+}
+
 static void send_del(struct send *send) {
+	if (send->thread) {
+		send_thread_release(send);
+		return;
+	}
+	if (send->overflow) {
+		LOG(send->id, "Output queue full (%zu bytes); disconnecting slow consumer", send->queue_length);
+	}
+	if (send->lagging) {
+		LOG(send->id, "Output lag over %" PRIu64 " ms; disconnecting slow consumer", send->output->max_lag_ms);
+	}
+	if (send->overflow || send->lagging || atomic_load_explicit(&send->counters.dropped_packets, memory_order_relaxed)) {
+		send_log_counters(send);
+	}
 	LOG(send->id, "Connection closed");
 	peer_count_out--;
+	send->output->num_sends--;
 	peer_close(&send->peer);
+	peer_close(&send->flush_peer);
 	list_del(&send->send_list);
+	list_del(&send->send_all_list);
+	if (send->pending) {
+		list_del(&send->send_pending_list);
+	}
 	peer_call(send->on_close);
+	for (size_t i = 0; i < send->queue_count; i++) {
+		send_slab_put(send->queue[send->queue_start + i].slab);
+	}
+	free(send->queue);
+	// The kernel holds its own page references for anything still in flight;
+	// at worst a socket we've given up on sees reused memory.
+	for (size_t i = 0; i < send->pins_count; i++) {
+		send_slab_put(send->pins[send->pins_start + i].slab);
+	}
+	free(send->pins);
 	free(send);
 }
 
-static void send_del_wrapper(struct peer *peer) {
-	send_del(container_of(peer, struct send, peer));
+static void send_queue_arm(struct send *send) {
+	bool want = send->queue_length > 0;
+	if (send->queue_armed != want) {
+		if (send->thread) {
+			send_thread_epoll(send->thread, EPOLL_CTL_MOD, &send->peer, want ? EPOLLOUT : 0);
+		} else {
+			peer_epoll_mod(&send->peer, want ? EPOLLOUT : 0);
+		}
+		send->queue_armed = want;
+	}
+}
+
+static void send_cork(struct send *send, bool cork) {
+	int val = cork;
+	assert(!setsockopt(send->peer.fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)));
+}
+
+static void send_flush_arm(struct send *send) {
+	if (send->flush_peer.fd == -1 || send->flush_armed) {
+		return;
+	}
+	struct itimerspec timer = {
+		.it_value = {
+			.tv_sec = send->output->flush_ms / 1000,
+			.tv_nsec = (send->output->flush_ms % 1000) * 1000000,
+		},
+	};
+	assert(!timerfd_settime(send->flush_peer.fd, 0, &timer, NULL));
+	send->flush_armed = true;
+}
+
+static void send_flush_handler(struct peer *peer) {
+	struct send *send = container_of(peer, struct send, flush_peer);
+	if (peer->fd == -1) {
+		// Released earlier in this worker batch
+		return;
+	}
+	uint64_t expirations;
+	assert(read(peer->fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+	send->flush_armed = false;
+	// Uncorking pushes out any partial frame the kernel is holding
+	send_cork(send, false);
+	send_cork(send, true);
+}
+
+static void send_queue_account(struct send *send) {
+	atomic_store_explicit(&send->counters.queued_bytes, send->queue_length, memory_order_relaxed);
+	send_counter_max(&send->counters.max_queued_bytes, send->queue_length);
+}
+
+static void send_queue_drop_oldest(struct send *send, size_t length) {
+	// Whole ranges only, and never one we've started writing; either would
+	// corrupt the framing on the wire.
+	size_t keep = send->queue_partial ? 1 : 0;
+	size_t drop = 0;
+	while (keep + drop < send->queue_count && send->queue_length + length > send->output->max_queue) {
+		struct send_range *range = &send->queue[send->queue_start + keep + drop];
+		send->queue_length -= range->end - range->start;
+		send_counter_add(&send->counters.dropped_packets, range->packets);
+		send_counter_add(&send->counters.dropped_bytes, range->end - range->start);
+		send_slab_put(range->slab);
+		drop++;
+	}
+	if (!drop) {
+		return;
+	}
+	if (keep) {
+		memmove(&send->queue[send->queue_start + keep], &send->queue[send->queue_start + keep + drop], (send->queue_count - keep - drop) * sizeof(*send->queue));
+	} else {
+		send->queue_start += drop;
+	}
+	send->queue_count -= drop;
+	if (!send->queue_count) {
+		send->queue_start = 0;
+	}
+}
+
+static void send_queue_append(struct send *send, struct send_slab *slab, size_t start, size_t length, uint64_t packets, uint64_t queued_ms) {
+	send->queue_length += length;
+	if (send->queue_count) {
+		struct send_range *last = &send->queue[send->queue_start + send->queue_count - 1];
+		if (last->slab == slab && last->end == start) {
+			last->end += length;
+			last->packets += packets;
+			return;
+		}
+	}
+	if (send->queue_start && send->queue_start + send->queue_count == send->queue_size) {
+		memmove(send->queue, &send->queue[send->queue_start], send->queue_count * sizeof(*send->queue));
+		send->queue_start = 0;
+	}
+	if (send->queue_count == send->queue_size) {
+		send->queue_size = send->queue_size ? send->queue_size * 2 : 16;
+		send->queue = realloc(send->queue, send->queue_size * sizeof(*send->queue));
+		assert(send->queue);
+	}
+	struct send_range *range = &send->queue[send->queue_start + send->queue_count++];
+	range->slab = slab;
+	range->start = start;
+	range->end = start + length;
+	range->packets = packets;
+	range->queued_ms = queued_ms;
+	send_slab_get(slab);
+}
+
+static void send_queue_consume(struct send *send, size_t length) {
+	send->queue_length -= length;
+	while (length) {
+		struct send_range *range = &send->queue[send->queue_start];
+		if (length < range->end - range->start) {
+			range->start += length;
+			send->queue_partial = true;
+			break;
+		}
+		length -= range->end - range->start;
+		send_slab_put(range->slab);
+		send->queue_start++;
+		send->queue_count--;
+		send->queue_partial = false;
+	}
+	if (!send->queue_count) {
+		send->queue_start = 0;
+	}
+}
+
+static ssize_t send_queue_writev(struct send *send, struct iovec *iov, int iovcnt, size_t length) {
+	if (!send->zerocopy || length < SEND_ZEROCOPY_MIN) {
+		return writev(send->peer.fd, iov, iovcnt);
+	}
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = (size_t) iovcnt,
+	};
+	ssize_t res = sendmsg(send->peer.fd, &msg, MSG_ZEROCOPY);
+	if (res == -1 && errno == ENOBUFS) {
+		// Out of socket option memory for notifications; copy this one
+		return writev(send->peer.fd, iov, iovcnt);
+	}
+	if (res > 0) {
+		// The kernel now references these slabs until it tells us otherwise
+		size_t pinned = 0;
+		for (size_t i = 0; pinned < (size_t) res; i++) {
+			struct send_range *range = &send->queue[send->queue_start + i];
+			send_pin_add(send, range->slab, send->zerocopy_seq);
+			pinned += range->end - range->start;
+		}
+		send->zerocopy_seq++;
+		send_counter_add(&send->counters.zerocopy_sends, 1);
+	}
+	return res;
+}
+
+static bool send_zerocopy_reap(struct send *send) {
+	// Completion notifications arrive on the socket error queue, which wakes us
+	// as EPOLLERR.
+	bool reaped = false;
+	while (true) {
+		uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		if (recvmsg(send->peer.fd, &msg, MSG_ERRQUEUE) == -1) {
+			break;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+						(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno) {
+				continue;
+			}
+			// ee_info..ee_data is the (inclusive) range of completed sends
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				send_counter_add(&send->counters.zerocopy_copied, err.ee_data - err.ee_info + 1);
+			}
+			send_pin_release(send, err.ee_data);
+			reaped = true;
+		}
+	}
+	return reaped;
+}
+
+static bool send_queue_flush(struct send *send) {
+	while (send->queue_count) {
+		struct iovec iov[SEND_IOV_MAX];
+		int iovcnt = 0;
+		size_t length = 0;
+		for (; iovcnt < SEND_IOV_MAX && (size_t) iovcnt < send->queue_count; iovcnt++) {
+			struct send_range *range = &send->queue[send->queue_start + (size_t) iovcnt];
+			iov[iovcnt].iov_base = &range->slab->data[range->start];
+			iov[iovcnt].iov_len = range->end - range->start;
+			length += iov[iovcnt].iov_len;
+		}
+		ssize_t res = send_queue_writev(send, iov, iovcnt, length);
+		if (res == -1 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+		if (res <= 0) {
+			return false;
+		}
+		send_queue_consume(send, (size_t) res);
+		send_flush_arm(send);
+	}
+	send_queue_arm(send);
+	send_queue_account(send);
+	return true;
+}
+
+static bool send_queue_wait(struct send *send, size_t length) {
+	while (send->queue_length + length > send->output->max_queue) {
+		struct pollfd pollfd = {
+			.fd = send->peer.fd,
+			.events = POLLOUT,
+		};
+		if (poll(&pollfd, 1, -1) == -1) {
+			assert(errno == EINTR);
+			continue;
+		}
+		if (!send_queue_flush(send)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool send_queue_write(struct send *send, struct send_slab *slab, size_t start, size_t length, uint64_t packets, uint64_t now_ms, bool can_wait) {
+	if (can_wait && send->blocking && !send_queue_wait(send, length)) {
+		return false;
+	}
+	if (send->queue_length + length > send->output->max_queue) {
+		if (send->output->policy == SEND_POLICY_DISCONNECT) {
+			send->overflow = true;
+			return false;
+		}
+		if (send->output->policy == SEND_POLICY_DROP_OLDEST) {
+			send_queue_drop_oldest(send, length);
+		}
+		if (send->queue_length + length > send->output->max_queue) {
+			// drop_newest, or drop_oldest without enough to drop
+			send_counter_add(&send->counters.dropped_packets, packets);
+			send_counter_add(&send->counters.dropped_bytes, length);
+			return true;
+		}
+	}
+	send_queue_append(send, slab, start, length, packets, now_ms);
+	send_queue_account(send);
+	uint64_t lag_ms = now_ms - send->queue[send->queue_start].queued_ms;
+	send_counter_max(&send->counters.max_lag_ms, lag_ms);
+	if (send->output->max_lag_ms && lag_ms > send->output->max_lag_ms) {
+		send->lagging = true;
+		return false;
+	}
+	if (!send->pending) {
+		list_add(&send->send_pending_list, send->thread ? &send->thread->pending_head : &send_pending_head);
+		send->pending = true;
+	}
+	return true;
+}
+
+static void send_flush_pending(struct list_head *pending_head) {
+	// End of an event loop iteration: one write per client for everything
+	// serialized since the last one.
+	struct send *iter, *next;
+	list_for_each_entry_safe(iter, next, pending_head, send_pending_list) {
+		list_del(&iter->send_pending_list);
+		iter->pending = false;
+		if (!send_queue_flush(iter)) {
+			send_del(iter);
+		}
+	}
+}
+
+static void send_handler(struct peer *peer) {
+	struct send *send = container_of(peer, struct send, peer);
+	if (peer->fd == -1) {
+		// Released earlier in this worker batch
+		return;
+	}
+	if (send->zerocopy && send_zerocopy_reap(send)) {
+		if (send->queue_length && !send_queue_flush(send)) {
+			send_del(send);
+		}
+		return;
+	}
+	// With nothing queued, we're only woken for hangup or error
+	if (!send->queue_length || !send_queue_flush(send)) {
+		send_del(send);
+	}
+}
+
+static void send_thread_add(struct send_thread *thread, struct send *send) {
+	list_add(&send->send_list, &thread->send_head[send->output->serializer - serializers]);
+	send_thread_epoll(thread, EPOLL_CTL_ADD, &send->peer, 0);
+	if (send->flush_peer.fd != -1) {
+		send_thread_epoll(thread, EPOLL_CTL_ADD, &send->flush_peer, EPOLLIN);
+	}
+}
+
+static void send_thread_data(struct send_thread *thread, struct send_msg *msg) {
+	struct send *iter, *next;
+	list_for_each_entry_safe(iter, next, &thread->send_head[msg->serializer], send_list) {
+		if (iter->stat.st_dev == msg->st_dev && iter->stat.st_ino == msg->st_ino) {
+			// Same socket that these packets came from
+			continue;
+		}
+		if ((send_output_filtered(iter->output) ? iter->output : NULL) != msg->output) {
+			continue;
+		}
+		if (!send_queue_write(iter, msg->slab, msg->start, msg->length, msg->packets, msg->queued_ms, msg->can_wait)) {
+			send_del(iter);
+		}
+	}
+	send_slab_put(msg->slab);
+}
+
+static void send_thread_wake_handler(struct peer *peer) {
+	struct send_thread *thread = container_of(peer, struct send_thread, wake_peer);
+
+	uint64_t events;
+	assert(read(peer->fd, &events, sizeof(events)) == sizeof(events));
+
+	struct send_msg msg;
+	while (ring_pop(thread->ring, &msg)) {
+		switch (msg.type) {
+			case SEND_MSG_ADD:
+				send_thread_add(thread, msg.send);
+				break;
+
+			case SEND_MSG_DATA:
+				send_thread_data(thread, &msg);
+				break;
+
+			case SEND_MSG_STOP:
+				thread->running = false;
+				break;
+		}
+	}
+
+	if (atomic_exchange_explicit(&thread->producer_waiting, false, memory_order_seq_cst)) {
+		uint64_t space = 1;
+		assert(write(thread->space_fd, &space, sizeof(space)) == sizeof(space));
+	}
+}
+
+static void *send_thread_main(void *arg) {
+	struct send_thread *thread = arg;
+
+	sigset_t sigmask;
+	assert(!sigfillset(&sigmask));
+	assert(!pthread_sigmask(SIG_BLOCK, &sigmask, NULL));
+
+	while (thread->running) {
+		struct epoll_event events[SEND_THREAD_MAX_EVENTS];
+		int nfds = epoll_wait(thread->epoll_fd, events, SEND_THREAD_MAX_EVENTS, -1);
+		if (nfds == -1 && errno == EINTR) {
+			continue;
+		}
+		assert(nfds >= 0);
+
+		for (int n = 0; n < nfds; n++) {
+			struct peer *peer = events[n].data.ptr;
+			peer->event_handler(peer);
+		}
+
+		send_flush_pending(&thread->pending_head);
+
+		if (!list_is_empty(&thread->dead_head)) {
+			// Freeing happens on the main thread, after we're done with this batch
+			assert(!pthread_mutex_lock(&send_reap_lock));
+			struct send *iter, *next;
+			list_for_each_entry_safe(iter, next, &thread->dead_head, send_list) {
+				list_del(&iter->send_list);
+				list_add(&iter->send_list, &send_reap_head);
+			}
+			assert(!pthread_mutex_unlock(&send_reap_lock));
+			uint64_t dead = 1;
+			assert(write(send_reap_peer.fd, &dead, sizeof(dead)) == sizeof(dead));
+		}
+	}
+	return NULL;
+}
+
+static void send_thread_wake(struct send_thread *thread) {
+	uint64_t wake = 1;
+	assert(write(thread->wake_peer.fd, &wake, sizeof(wake)) == sizeof(wake));
+}
+
+static void send_thread_push(struct send_thread *thread, const struct send_msg *msg) {
+	while (!ring_push(thread->ring, msg)) {
+		// Worker is behind; wake it and wait for room
+		atomic_store_explicit(&thread->producer_waiting, true, memory_order_seq_cst);
+		send_thread_wake(thread);
+		if (ring_push(thread->ring, msg)) {
+			break;
+		}
+		uint64_t space;
+		if (read(thread->space_fd, &space, sizeof(space)) == -1) {
+			assert(errno == EINTR);
+		}
+	}
+	thread->dirty = true;
+}
+
+static void send_thread_unstage(struct send_thread *thread) {
+	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
+		if (thread->staged[i].slab) {
+			send_thread_push(thread, &thread->staged[i]);
+			thread->staged[i].slab = NULL;
+		}
+	}
+}
+
+static void send_thread_stage(struct send_thread *thread, size_t serializer, struct send_output *output, struct send_slab *slab, size_t start, size_t length, uint64_t packets, uint64_t now_ms, struct stat *input_stat, bool can_wait) {
+	// Consecutive packets from the same input become one message
+	struct send_msg *msg = &thread->staged[serializer];
+	if (msg->slab == slab &&
+			msg->output == output &&
+			msg->start + msg->length == start &&
+			msg->st_dev == input_stat->st_dev &&
+			msg->st_ino == input_stat->st_ino &&
+			msg->can_wait == can_wait) {
+		msg->length += length;
+		msg->packets += packets;
+		return;
+	}
+	if (msg->slab) {
+		send_thread_push(thread, msg);
+	}
+	send_slab_get(slab);
+	msg->type = SEND_MSG_DATA;
+	msg->send = NULL;
+	msg->serializer = serializer;
+	msg->output = output;
+	msg->slab = slab;
+	msg->start = start;
+	msg->length = length;
+	msg->packets = packets;
+	msg->queued_ms = now_ms;
+	msg->st_dev = input_stat->st_dev;
+	msg->st_ino = input_stat->st_ino;
+	msg->can_wait = can_wait;
+}
+
+static void send_thread_hand_off(struct send *send) {
+	struct send_thread *thread = &send_threads[0];
+	for (size_t i = 1; i < send_num_threads; i++) {
+		if (send_threads[i].num_sends < thread->num_sends) {
+			thread = &send_threads[i];
+		}
+	}
+	size_t serializer = (size_t) (send->output->serializer - serializers);
+	thread->num_sends++;
+	thread->send_count[serializer]++;
+	send->thread = thread;
+
+	// Don't let the new send see packets serialized before it arrived
+	send_thread_unstage(thread);
+
+	struct send_msg msg = {
+		.type = SEND_MSG_ADD,
+		.send = send,
+	};
+	send_thread_push(thread, &msg);
+}
+
+static void send_reap() {
+	struct list_head reap_head = LIST_HEAD_INIT(reap_head);
+	assert(!pthread_mutex_lock(&send_reap_lock));
+	struct send *iter, *next;
+	list_for_each_entry_safe(iter, next, &send_reap_head, send_list) {
+		list_del(&iter->send_list);
+		list_add(&iter->send_list, &reap_head);
+	}
+	assert(!pthread_mutex_unlock(&send_reap_lock));
+
+	list_for_each_entry_safe(iter, next, &reap_head, send_list) {
+		struct send_thread *thread = iter->thread;
+		size_t serializer = (size_t) (iter->output->serializer - serializers);
+		thread->num_sends--;
+		thread->send_count[serializer]--;
+		iter->thread = NULL;
+		send_del(iter);
+	}
+}
+
+static void send_reap_handler(struct peer *peer) {
+	uint64_t dead;
+	assert(read(peer->fd, &dead, sizeof(dead)) == sizeof(dead));
+	send_reap();
+}
+
+static void send_pending_handler(struct peer __attribute__ ((unused)) *peer) {
+	for (size_t i = 0; i < send_num_threads; i++) {
+		struct send_thread *thread = &send_threads[i];
+		send_thread_unstage(thread);
+		if (thread->dirty) {
+			send_thread_wake(thread);
+			thread->dirty = false;
+		}
+	}
+	send_flush_pending(&send_pending_head);
+}
+
+static void send_stats_handler(struct peer *peer) {
+	struct signalfd_siginfo siginfo;
+	assert(read(peer->fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo));
+	LOG(server_id, "Received signal %u; logging statistics", siginfo.ssi_signo);
+	receive_log_all_counters();
+	struct send *iter;
+	list_for_each_entry(iter, &send_all_head, send_all_list) {
+		send_log_counters(iter);
+	}
+}
+
+static void send_threads_init() {
+	if (!send_num_threads) {
+		return;
+	}
+
+	send_reap_peer.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(send_reap_peer.fd >= 0);
+	send_reap_peer.event_handler = send_reap_handler;
+	peer_epoll_add(&send_reap_peer, EPOLLIN);
+
+	send_threads = malloc(send_num_threads * sizeof(*send_threads));
+	assert(send_threads);
+	for (size_t i = 0; i < send_num_threads; i++) {
+		struct send_thread *thread = &send_threads[i];
+		thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		assert(thread->epoll_fd >= 0);
+		thread->wake_peer.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		assert(thread->wake_peer.fd >= 0);
+		thread->wake_peer.event_handler = send_thread_wake_handler;
+		send_thread_epoll(thread, EPOLL_CTL_ADD, &thread->wake_peer, EPOLLIN);
+		thread->space_fd = eventfd(0, EFD_CLOEXEC);
+		assert(thread->space_fd >= 0);
+		atomic_init(&thread->producer_waiting, false);
+		thread->ring = ring_new(sizeof(struct send_msg), SEND_RING_LEN);
+		thread->running = true;
+		for (size_t j = 0; j < NUM_SERIALIZERS; j++) {
+			list_head_init(&thread->send_head[j]);
+			thread->send_count[j] = 0;
+			thread->staged[j].slab = NULL;
+		}
+		list_head_init(&thread->pending_head);
+		list_head_init(&thread->dead_head);
+		thread->num_sends = 0;
+		thread->dirty = false;
+		assert(!pthread_create(&thread->thread, NULL, send_thread_main, thread));
+	}
+}
+
+static void send_threads_cleanup() {
+	if (!send_num_threads) {
+		return;
+	}
+
+	for (size_t i = 0; i < send_num_threads; i++) {
+		struct send_thread *thread = &send_threads[i];
+		send_thread_unstage(thread);
+		struct send_msg msg = {
+			.type = SEND_MSG_STOP,
+		};
+		send_thread_push(thread, &msg);
+		send_thread_wake(thread);
+	}
+	for (size_t i = 0; i < send_num_threads; i++) {
+		assert(!pthread_join(send_threads[i].thread, NULL));
+	}
+
+	send_reap();
+
+	// Hand the survivors back to the main thread for the final flush
+	for (size_t i = 0; i < send_num_threads; i++) {
+		struct send_thread *thread = &send_threads[i];
+		for (size_t j = 0; j < NUM_SERIALIZERS; j++) {
+			struct send *iter, *next;
+			list_for_each_entry_safe(iter, next, &thread->send_head[j], send_list) {
+				send_thread_epoll(thread, EPOLL_CTL_DEL, &iter->peer, 0);
+				if (iter->flush_peer.fd != -1) {
+					send_thread_epoll(thread, EPOLL_CTL_DEL, &iter->flush_peer, 0);
+					peer_epoll_add(&iter->flush_peer, EPOLLIN);
+				}
+				peer_epoll_add(&iter->peer, iter->queue_armed ? EPOLLOUT : 0);
+				list_del(&iter->send_list);
+				list_add(&iter->send_list, &serializers[j].send_head);
+				iter->thread = NULL;
+			}
+		}
+		assert(!close(thread->epoll_fd));
+		assert(!close(thread->wake_peer.fd));
+		assert(!close(thread->space_fd));
+		ring_del(thread->ring);
+	}
+	free(send_threads);
+	send_threads = NULL;
+	peer_close(&send_reap_peer);
 }
 
 static void send_new(int fd, void *passthrough, struct peer *on_close) {
-	struct serializer *serializer = (struct serializer *) passthrough;
+	struct send_output *output = (struct send_output *) passthrough;
 
 	peer_count_out++;
+	output->num_sends++;
+	if (output->serializer->restart) {
+		output->serializer->restart();
+	}
 
 	struct send *send = malloc(sizeof(*send));
 	assert(send);
 
 	send->peer.fd = fd;
-	send->peer.event_handler = send_del_wrapper;
+	send->peer.event_handler = send_handler;
 	send->on_close = on_close;
 	uuid_gen(send->id);
-	send->serializer = serializer;
+	send->output = output;
+	send->thread = NULL;
+	send->queue = NULL;
+	send->queue_size = send->queue_start = send->queue_count = send->queue_length = 0;
+	send->queue_armed = false;
+	send->queue_partial = false;
+	send->pending = false;
+	send->flush_peer.fd = -1;
+	send->flush_armed = false;
+	send->overflow = false;
+	send->lagging = false;
+	send->zerocopy = false;
+	send->zerocopy_seq = 0;
+	send->pins = NULL;
+	send->pins_size = send->pins_start = send->pins_count = 0;
+	atomic_init(&send->counters.queued_bytes, 0);
+	atomic_init(&send->counters.max_queued_bytes, 0);
+	atomic_init(&send->counters.dropped_packets, 0);
+	atomic_init(&send->counters.dropped_bytes, 0);
+	atomic_init(&send->counters.max_lag_ms, 0);
+	atomic_init(&send->counters.zerocopy_sends, 0);
+	atomic_init(&send->counters.zerocopy_copied, 0);
+	list_add(&send->send_all_list, &send_all_head);
 	assert(!fstat(fd, &send->stat));
 
-	list_add(&send->send_list, &serializer->send_head);
+	int flags = fcntl(fd, F_GETFL);
+	assert(flags >= 0);
+	struct stat st;
+	assert(!fstat(fd, &st));
+	send->blocking = !(flags & O_NONBLOCK);
+	if (send->blocking && !isatty(fd) && !S_ISREG(st.st_mode)) {
+		// A tty usually shares its file description with our stderr, and log
+		// writes don't handle EAGAIN. Regular files ignore O_NONBLOCK.
+		assert(!fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+	} else {
+		send->blocking = false;
+	}
+
+	LOG(send->id, "New send connection: %s", output->serializer->name);
+
+	if (output->flush_ms) {
+		int val = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val))) {
+			LOG(send->id, "Not a TCP socket; ignoring flush_ms");
+		} else {
+			send->flush_peer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			assert(send->flush_peer.fd >= 0);
+			send->flush_peer.event_handler = send_flush_handler;
+		}
+	}
+
+	if (output->zerocopy) {
+		int val = 1;
+		if (!S_ISSOCK(send->stat.st_mode) || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val))) {
+			LOG(send->id, "Zerocopy not supported on this connection; copying");
+		} else {
+			send->zerocopy = true;
+		}
+	}
+
+	if (send_num_threads && S_ISSOCK(send->stat.st_mode)) {
+		send_thread_hand_off(send);
+		return;
+	}
+
+	list_add(&send->send_list, &output->serializer->send_head);
 
 	peer_epoll_add(&send->peer, 0);
+	if (send->flush_peer.fd != -1) {
+		peer_epoll_add(&send->flush_peer, EPOLLIN);
+	}
+}
 
-	LOG(send->id, "New send connection: %s", serializer->name);
+static struct serializer *send_get_serializer(const char *name) {
+	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
+		if (strcasecmp(serializers[i].name, name) == 0) {
+			return &serializers[i];
+		}
+	}
+	return NULL;
 }
 
 static struct serializer *send_parse_format(const char **arg) {
@@ -139,61 +1244,437 @@ static struct serializer *send_parse_format(const char **arg) {
 	return serializer;
 }
 
+static bool send_option_flush_ms(struct send_output *output, const char *arg) {
+	char *end;
+	unsigned long val = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || val > UINT32_MAX) {
+		return false;
+	}
+	output->flush_ms = (uint32_t) val;
+	return true;
+}
+
+static bool send_option_policy(struct send_output *output, const char *arg) {
+	for (size_t i = 0; i < NUM_SEND_POLICIES; i++) {
+		if (strcasecmp(send_policy_names[i], arg) == 0) {
+			output->policy = (enum send_policy) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool send_option_max_queue(struct send_output *output, const char *arg) {
+	char *end;
+	unsigned long long val = strtoull(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || val < SEND_SLAB_LEN || val > SIZE_MAX / 2) {
+		return false;
+	}
+	output->max_queue = (size_t) val;
+	return true;
+}
+
+static bool send_option_max_lag_ms(struct send_output *output, const char *arg) {
+	char *end;
+	unsigned long long val = strtoull(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end) {
+		return false;
+	}
+	output->max_lag_ms = (uint64_t) val;
+	return true;
+}
+
+static bool send_option_max_per_icao_hz(struct send_output *output, const char *arg) {
+	char *end;
+	double val = strtod(arg, &end);
+	if (arg[0] < '0' || arg[0] > '9' || *end || !(val > 0) || val > 1000) {
+		return false;
+	}
+	output->icao_interval_ms = (uint64_t) (1000 / val + 0.5);
+	return true;
+}
+
+static bool send_option_sample(struct send_output *output, const char *arg) {
+	if (strncmp(arg, "1/", 2)) {
+		return false;
+	}
+	arg += 2;
+	char *end;
+	unsigned long val = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || !val || val > UINT32_MAX) {
+		return false;
+	}
+	output->sample_n = (uint32_t) val;
+	return true;
+}
+
+static bool send_option_dedup(struct send_output *output, const char *arg) {
+	if (strcasecmp(arg, "on") == 0) {
+		output->dedup = true;
+	} else if (strcasecmp(arg, "off") == 0) {
+		output->dedup = false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool send_option_zerocopy(struct send_output *output, const char *arg) {
+	if (strcasecmp(arg, "on") == 0) {
+		output->zerocopy = true;
+	} else if (strcasecmp(arg, "off") == 0) {
+		output->zerocopy = false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static void send_output_reset(struct send_output *output) {
+	output->flush_ms = 0;
+	output->zerocopy = false;
+	output->policy = SEND_POLICY_DISCONNECT;
+	output->max_queue = SEND_QUEUE_LEN_DEFAULT;
+	output->max_lag_ms = 0;
+	output->dedup = false;
+	output->icao_interval_ms = 0;
+	output->icao_table = NULL;
+	output->sample_n = 1;
+	output->sample_count = 0;
+	output->num_sends = 0;
+}
+
+static void send_output_add(struct send_output *output) {
+	if (output->dedup) {
+		dedup_enable();
+	}
+	if (output->icao_interval_ms) {
+		output->icao_table = icao_table_new(output->icao_interval_ms);
+	}
+	list_add(&output->send_output_list, &send_output_head);
+}
+
+static bool send_output_pass(struct send_output *output, struct packet *packet, bool duplicate, uint64_t now_ms) {
+	if (output->dedup && duplicate) {
+		return false;
+	}
+	if (output->sample_n > 1 && output->sample_count++ % output->sample_n) {
+		return false;
+	}
+	uint32_t icao;
+	if (output->icao_table && packet_get_icao(packet, &icao) && !icao_table_check(output->icao_table, icao, now_ms)) {
+		return false;
+	}
+	return true;
+}
+
+static bool send_parse_options(struct send_output *output, const char *arg) {
+	char *options = strdup(arg);
+	assert(options);
+	bool ret = true;
+	char *saveptr, *option;
+	for (char *str = options; ret && (option = strtok_r(str, ",", &saveptr)); str = NULL) {
+		char *value = strchr(option, '=');
+		if (!value) {
+			ret = false;
+			break;
+		}
+		*(value++) = '\0';
+		size_t i = 0;
+		for (; i < NUM_SEND_OPTIONS && strcasecmp(send_options[i].name, option); i++) {
+		}
+		if (i == NUM_SEND_OPTIONS) {
+			fprintf(stderr, "Unknown send option: %s\n", option);
+			ret = false;
+			break;
+		}
+		ret = send_options[i].handler(output, value);
+	}
+	free(options);
+	if (ret && output->serializer->restart && output->policy != SEND_POLICY_DISCONNECT) {
+		ret = false;
+	}
+	if (ret && (output->serializer->restart || output->serializer->unfiltered) && send_output_filtered(output)) {
+		ret = false;
+	}
+	return ret;
+}
+
+static bool send_looks_like_options(const char *arg) {
+	// Every comma-separated item is "name=value" with a plain name
+	while (true) {
+		size_t name_len = strspn(arg, "abcdefghijklmnopqrstuvwxyz_ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+		if (!name_len || arg[name_len] != '=') {
+			return false;
+		}
+		arg = strchr(arg + name_len, ',');
+		if (!arg) {
+			return true;
+		}
+		arg++;
+	}
+}
+
+static struct send_output *send_output_new(struct serializer *serializer, const char *arg, char **target) {
+	struct send_output *output = malloc(sizeof(*output));
+	assert(output);
+	output->serializer = serializer;
+	send_output_reset(output);
+
+	// Options trail the target: "TARGET,name=value[,...]". Paths and commands
+	// may contain commas, so the split is at the first comma that is followed by
+	// nothing but option-shaped items. Those must then all be valid, so a
+	// mistyped option is an error rather than part of the target.
+	const char *split = arg;
+	while ((split = strchr(split, ',')) && !send_looks_like_options(split + 1)) {
+		split++;
+	}
+	if (split) {
+		if (!send_parse_options(output, split + 1)) {
+			free(output);
+			return NULL;
+		}
+		*target = strndup(arg, (size_t) (split - arg));
+	} else {
+		*target = strdup(arg);
+	}
+	assert(*target);
+
+	send_output_add(output);
+	return output;
+}
+
+void send_opts_add() {
+	opts_add("send-threads", "NUM", send_set_threads, send_opts);
+}
+
 void send_init() {
+	opts_call(send_opts);
 	assert(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
+		serializers[i].slab = NULL;
+		serializers[i].wanted_count = 0;
 		list_head_init(&serializers[i].send_head);
 	}
+	send_threads_init();
+
+	sigset_t sigmask;
+	assert(!sigemptyset(&sigmask));
+	assert(!sigaddset(&sigmask, SIGUSR1));
+	send_stats_peer.fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	assert(send_stats_peer.fd >= 0);
+	send_stats_peer.event_handler = send_stats_handler;
+	peer_epoll_add(&send_stats_peer, EPOLLIN);
+	assert(!sigprocmask(SIG_BLOCK, &sigmask, NULL));
+
+	send_pending_peer.fd = -1;
+	send_pending_peer.event_handler = send_pending_handler;
+	peer_loop_hook_add(&send_pending_peer);
 }
 
 void send_cleanup() {
+	send_threads_cleanup();
+	peer_close(&send_stats_peer);
+
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
 		struct send *iter, *next;
 		list_for_each_entry_safe(iter, next, &serializers[i].send_head, send_list) {
+			if (iter->blocking && iter->queue_length) {
+				// This was a blocking fd before we got to it; keep the old guarantee
+				// that everything gets written before exit.
+				int flags = fcntl(iter->peer.fd, F_GETFL);
+				assert(flags >= 0);
+				assert(!fcntl(iter->peer.fd, F_SETFL, flags & ~O_NONBLOCK));
+			}
+			send_queue_flush(iter);
 			send_del(iter);
 		}
+		if (serializers[i].slab) {
+			send_slab_put(serializers[i].slab);
+		}
 	}
-}
 
-void *send_get_serializer(const char *name) {
-	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
-		if (strcasecmp(serializers[i].name, name) == 0) {
-			return &serializers[i];
+	struct send_output *iter, *next;
+	list_for_each_entry_safe(iter, next, &send_output_head, send_output_list) {
+		list_del(&iter->send_output_list);
+		if (iter->icao_table) {
+			icao_table_del(iter->icao_table);
 		}
+		free(iter);
 	}
-	return NULL;
+}
+
+void *send_get_output(const char *arg) {
+	const char *comma = strchr(arg, ',');
+	char *format = comma ? strndup(arg, (size_t) (comma - arg)) : strdup(arg);
+	assert(format);
+	struct serializer *serializer = send_get_serializer(format);
+	free(format);
+	if (!serializer) {
+		return NULL;
+	}
+	struct send_output *output = malloc(sizeof(*output));
+	assert(output);
+	output->serializer = serializer;
+	send_output_reset(output);
+	if (comma && !send_parse_options(output, comma + 1)) {
+		free(output);
+		return NULL;
+	}
+	send_output_add(output);
+	return output;
 }
 
 void send_get_hello(struct buf **buf_pp, void *passthrough) {
-	struct serializer *serializer = (struct serializer *) passthrough;
-	if (serializer->hello) {
-		serializer->hello(buf_pp);
+	struct send_output *output = (struct send_output *) passthrough;
+	if (output->serializer->hello) {
+		output->serializer->hello(buf_pp);
 	}
 }
 
-void send_write(struct packet *packet) {
-	packet_sanity_check(packet);
+// A serialized batch: record i is [offsets[i], offsets[i + 1]) from start in
+// slab, empty for packets that no output wanted.
+struct send_block {
+	struct send_slab *slab;
+	size_t start;
+	size_t offsets[PACKET_BATCH_MAX + 1];
+	size_t count;
+};
+
+static void send_thread_stage_outputs(struct send_thread *thread, struct serializer *serializer, const struct send_block *block, uint64_t now_ms, struct stat *input_stat, bool can_wait) {
+	// One message for all unfiltered sends, plus one per run of packets that
+	// each filtered output let through
+	size_t i = (size_t) (serializer - serializers);
+	bool unfiltered = false;
+	struct send_output *output;
+	list_for_each_entry(output, &send_output_head, send_output_list) {
+		if (output->serializer != serializer || !output->pass_count) {
+			continue;
+		}
+		if (send_output_filtered(output)) {
+			for (size_t j = 0; j < block->count; j++) {
+				if (!output->pass[j]) {
+					continue;
+				}
+				size_t k = j + 1;
+				while (k < block->count && output->pass[k]) {
+					k++;
+				}
+				send_thread_stage(thread, i, output, block->slab, block->start + block->offsets[j], block->offsets[k] - block->offsets[j], k - j, now_ms, input_stat, can_wait);
+				j = k;
+			}
+		} else if (!unfiltered) {
+			send_thread_stage(thread, i, NULL, block->slab, block->start, block->offsets[block->count], serializer->wanted_count, now_ms, input_stat, can_wait);
+			unfiltered = true;
+		}
+	}
+}
+
+static bool send_queue_write_block(struct send *send, const struct send_block *block, uint64_t now_ms, bool can_wait) {
+	// Runs of packets that passed this output go in whole, unless they'd cross
+	// max_queue; then the policy decides packet by packet, as it would have
+	// unbatched.
+	const bool *pass = send_output_filtered(send->output) ? send->output->pass : NULL;
+	for (size_t i = 0; i < block->count;) {
+		if (pass && !pass[i]) {
+			i++;
+			continue;
+		}
+		size_t j = i + 1;
+		while (j < block->count && (!pass || pass[j])) {
+			j++;
+		}
+		if (send->queue_length + block->offsets[j] - block->offsets[i] > send->output->max_queue) {
+			j = i + 1;
+		}
+		size_t length = block->offsets[j] - block->offsets[i];
+		if (length && !send_queue_write(send, block->slab, block->start + block->offsets[i], length, j - i, now_ms, can_wait)) {
+			return false;
+		}
+		i = j;
+	}
+	return true;
+}
+
+void send_write_batch(struct packet_batch *batch) {
+	packet_batch_sanity_check(batch);
+	uint64_t now_ms = send_get_time_ms();
+	// All from one input
+	struct stat *input_stat = batch->packets[0].input_stat;
+
+	// Decide per output first, so nobody serializes for clients that would
+	// drop the result.
+	struct send_output *output;
+	list_for_each_entry(output, &send_output_head, send_output_list) {
+		output->pass_count = 0;
+		if (!output->num_sends) {
+			continue;
+		}
+		struct serializer *serializer = output->serializer;
+		for (size_t i = 0; i < batch->count; i++) {
+			output->pass[i] = send_output_pass(output, &batch->packets[i], batch->duplicate[i], now_ms);
+			if (output->pass[i]) {
+				output->pass_count++;
+				if (!serializer->wanted[i]) {
+					serializer->wanted[i] = true;
+					serializer->wanted_count++;
+				}
+			}
+		}
+	}
+
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
 		struct serializer *serializer = &serializers[i];
-		if (list_is_empty(&serializer->send_head)) {
+		if (!serializer->wanted_count) {
 			continue;
 		}
-		struct buf buf = BUF_INIT;
-		serializer->serialize(packet, &buf);
+
+		// Serialize the whole batch into one block, then share it
+		uint8_t data[PACKET_BATCH_MAX * BUF_LEN_MAX];
+		struct buf buf = BUF_INIT(data);
+		struct send_block block = {
+			.count = batch->count,
+		};
+		for (size_t j = 0; j < batch->count; j++) {
+			block.offsets[j] = buf.length;
+			if (!serializer->wanted[j]) {
+				continue;
+			}
+			serializer->wanted[j] = false;
+			struct buf record = {
+				.buf = buf_at(&buf, buf.length),
+				.size = BUF_LEN_MAX,
+			};
+			serializer->serialize(&batch->packets[j], &record);
+			buf.length += record.length;
+		}
+		block.offsets[batch->count] = buf.length;
 		if (buf.length == 0) {
+			serializer->wanted_count = 0;
 			continue;
 		}
+		block.slab = send_slab_append(serializer, &buf, &block.start);
+		// Reading from a regular file has no deadline, so we can let a consumer that
+		// was blocking before we got to it slow us down instead of dropping it.
+		bool can_wait = S_ISREG(input_stat->st_mode);
+		for (size_t j = 0; j < send_num_threads; j++) {
+			if (send_threads[j].send_count[i]) {
+				send_thread_stage_outputs(&send_threads[j], serializer, &block, now_ms, input_stat, can_wait);
+			}
+		}
+		serializer->wanted_count = 0;
 		struct send *iter, *next;
 		list_for_each_entry_safe(iter, next, &serializer->send_head, send_list) {
-			if (iter->stat.st_dev == packet->input_stat->st_dev &&
-					iter->stat.st_ino == packet->input_stat->st_ino) {
-				// Same socket that this packet came from
+			if (!iter->output->pass_count) {
+				continue;
+			}
+			if (iter->stat.st_dev == input_stat->st_dev &&
+					iter->stat.st_ino == input_stat->st_ino) {
+				// Same socket that these packets came from
 				continue;
 			}
-			if (write(iter->peer.fd, buf_at(&buf, 0), buf.length) != (ssize_t) buf.length) {
-				// peer_loop() will see this shutdown and call send_del
-				// Ignore error
-				shutdown(iter->peer.fd, SHUT_WR);
+			if (!send_queue_write_block(iter, &block, now_ms, can_wait)) {
+				send_del(iter);
 			}
 		}
 	}
@@ -204,6 +1685,10 @@ void send_print_usage() {
 	for (size_t i = 0; i < NUM_SERIALIZERS; i++) {
 		fprintf(stderr, "\t%s\n", serializers[i].name);
 	}
+	fprintf(stderr, "\nSupported send options (FORMAT=TARGET,OPTION=VALUE,...):\n");
+	for (size_t i = 0; i < NUM_SEND_OPTIONS; i++) {
+		fprintf(stderr, "\t%s=%s\n", send_options[i].name, send_options[i].arg_help);
+	}
 }
 
 bool send_add(bool (*next)(const char *, struct flow *, void *), struct flow *flow, const char *arg) {
@@ -211,5 +1696,12 @@ bool send_add(bool (*next)(const char *, struct flow *, void *), struct flow *fl
 	if (!serializer) {
 		return false;
 	}
-	return next(arg, flow, serializer);
+	char *target;
+	struct send_output *output = send_output_new(serializer, arg, &target);
+	if (!output) {
+		return false;
+	}
+	bool ret = next(target, flow, output);
+	free(target);
+	return ret;
 }
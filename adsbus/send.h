@@ -4,13 +4,14 @@
 
 struct buf;
 struct flow;
-struct packet;
+struct packet_batch;
 
+void send_opts_add(void);
 void send_init(void);
 void send_cleanup(void);
-void *send_get_serializer(const char *);
+void *send_get_output(const char *);
 void send_get_hello(struct buf **, void *);
-void send_write(struct packet *);
+void send_write_batch(struct packet_batch *);
 void send_print_usage(void);
 bool send_add(bool (*)(const char *, struct flow *, void *), struct flow *, const char *);
 extern struct flow *send_flow;
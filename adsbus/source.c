@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uuid.h"
+
+#include "source.h"
+
+#define SOURCE_INDEX_BITS_MIN 8
+#define SOURCE_COLLECT_MIN 4096
+#define SOURCE_NONE UINT32_MAX
+
+struct source {
+	uint8_t id[UUID_LEN];
+	bool used;
+	uint32_t hash;
+	uint32_t ref_count;
+	uint32_t next_free;
+};
+
+// Handles are indexes into sources; freed entries are reused.
+static struct source *sources = NULL;
+static uint32_t source_size = 0;
+static uint32_t source_high = 0;
+static uint32_t source_count = 0;
+static uint32_t source_free = SOURCE_NONE;
+// Open-addressed, by ID; holds handle + 1, with 0 meaning empty.
+static uint32_t *source_index = NULL;
+static unsigned source_index_bits = 0;
+static uint32_t source_collect_at = SOURCE_COLLECT_MIN;
+// Consecutive packets are usually from the same source; skip the hash.
+static uint32_t source_last = SOURCE_NONE;
+
+static uint32_t source_hash(const uint8_t *id) {
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	for (const uint8_t *c = id; *c; c++) {
+		hash = (hash ^ *c) * 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t *source_find(const uint8_t *id, uint32_t hash) {
+	uint32_t mask = (1U << source_index_bits) - 1;
+	for (uint32_t i = (hash * 0x9e3779b1U) >> (32 - source_index_bits);; i = (i + 1) & mask) {
+		uint32_t *slot = &source_index[i];
+		if (!*slot) {
+			return slot;
+		}
+		const struct source *source = &sources[*slot - 1];
+		if (source->hash == hash && !strcmp((const char *) source->id, (const char *) id)) {
+			return slot;
+		}
+	}
+}
+
+static void source_reindex(unsigned bits) {
+	free(source_index);
+	source_index_bits = bits;
+	source_index = calloc((size_t) 1 << bits, sizeof(*source_index));
+	assert(source_index);
+	for (uint32_t i = 0; i < source_high; i++) {
+		if (sources[i].used) {
+			*source_find(sources[i].id, sources[i].hash) = i + 1;
+		}
+	}
+}
+
+static uint32_t source_alloc(const uint8_t *id, uint32_t hash) {
+	size_t len = strlen((const char *) id);
+	assert(len < UUID_LEN);
+
+	uint32_t handle;
+	if (source_free != SOURCE_NONE) {
+		handle = source_free;
+		source_free = sources[handle].next_free;
+	} else {
+		if (source_high == source_size) {
+			source_size = source_size ? source_size * 2 : 64;
+			sources = realloc(sources, source_size * sizeof(*sources));
+			assert(sources);
+		}
+		handle = source_high++;
+	}
+
+	struct source *source = &sources[handle];
+	memcpy(source->id, id, len + 1);
+	source->used = true;
+	source->hash = hash;
+	source->ref_count = 0;
+	source_count++;
+	return handle;
+}
+
+void source_init() {
+	source_reindex(SOURCE_INDEX_BITS_MIN);
+}
+
+void source_cleanup() {
+	free(source_index);
+	free(sources);
+}
+
+uint32_t source_intern(const uint8_t *id) {
+	if (source_last != SOURCE_NONE && !strcmp((const char *) sources[source_last].id, (const char *) id)) {
+		return source_last;
+	}
+
+	uint32_t hash = source_hash(id);
+	uint32_t *slot = source_find(id, hash);
+	if (*slot) {
+		return source_last = *slot - 1;
+	}
+
+	uint32_t handle = source_alloc(id, hash);
+	*slot = handle + 1;
+	if (source_count * 2 > 1U << source_index_bits) {
+		source_reindex(source_index_bits + 1);
+	}
+	return source_last = handle;
+}
+
+const uint8_t *source_get(uint32_t handle) {
+	// Valid until the next source_intern()
+	assert(source_valid(handle));
+	return sources[handle].id;
+}
+
+bool source_valid(uint32_t handle) {
+	return handle < source_high && sources[handle].used;
+}
+
+void source_ref(uint32_t handle) {
+	assert(source_valid(handle));
+	sources[handle].ref_count++;
+}
+
+void source_unref(uint32_t handle) {
+	assert(source_valid(handle));
+	assert(sources[handle].ref_count);
+	sources[handle].ref_count--;
+}
+
+bool source_cache_hit(struct source_cache *cache, uint32_t handle) {
+	// On a miss, the reference moves to handle and the caller rebuilds
+	if (cache->valid && cache->source == handle) {
+		return true;
+	}
+	source_ref(handle);
+	source_cache_clear(cache);
+	cache->source = handle;
+	cache->valid = true;
+	return false;
+}
+
+void source_cache_clear(struct source_cache *cache) {
+	if (cache->valid) {
+		source_unref(cache->source);
+		cache->valid = false;
+	}
+}
+
+void source_collect() {
+	// Only safe between batches, when every handle still in use is referenced.
+	// Sources that send garbage IDs can't grow the table without bound.
+	if (source_count < source_collect_at) {
+		return;
+	}
+	for (uint32_t i = 0; i < source_high; i++) {
+		struct source *source = &sources[i];
+		if (source->used && !source->ref_count) {
+			source->used = false;
+			source->next_free = source_free;
+			source_free = i;
+			source_count--;
+		}
+	}
+	source_last = SOURCE_NONE;
+	source_reindex(source_index_bits);
+	source_collect_at = source_count * 2 > SOURCE_COLLECT_MIN ? source_count * 2 : SOURCE_COLLECT_MIN;
+}
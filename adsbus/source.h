@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Interned source IDs. Packets carry a dense 32-bit handle instead of the
+// ID string. A handle stays valid until the next source_collect() unless
+// someone holds a reference to it.
+void source_init(void);
+void source_cleanup(void);
+uint32_t __attribute__ ((warn_unused_result)) source_intern(const uint8_t *);
+const uint8_t * __attribute__ ((warn_unused_result)) source_get(uint32_t);
+bool __attribute__ ((warn_unused_result)) source_valid(uint32_t);
+void source_ref(uint32_t);
+void source_unref(uint32_t);
+void source_collect(void);
+
+// A referenced handle that a caller has derived something from (e.g. a
+// serialized ID). Consecutive packets are usually from the same source, so
+// most lookups hit. Zero-initialized means empty.
+struct source_cache {
+	uint32_t source;
+	bool valid;
+};
+bool __attribute__ ((warn_unused_result)) source_cache_hit(struct source_cache *, uint32_t);
+void source_cache_clear(struct source_cache *);
@@ -2,7 +2,10 @@
 #include <time.h>
 #include <jansson.h>
 
+#include "aircraft.h"
 #include "buf.h"
+#include "crc.h"
+#include "dedup.h"
 #include "json.h"
 #include "packet.h"
 
@@ -20,14 +23,13 @@ void stats_init() {
 	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &stats_state.start));
 }
 
-void stats_serialize(struct packet *packet, struct buf *buf) {
-	if (packet) {
-		stats_state.total_count++;
-		stats_state.type_count[packet->type]++;
-	}
-	if (stats_state.total_count % 1000 != 0) {
-		return;
-	}
+static void stats_to_buf(json_t *out, size_t flags, struct buf *buf) {
+	assert(json_dump_callback(out, json_buf_append_callback, buf, flags) == 0);
+	json_decref(out);
+	buf_chr(buf, buf->length++) = '\n';
+}
+
+static void stats_serialize_counts(struct buf *buf) {
 	json_t *counts = json_object();
 	for (int i = 0; i < NUM_TYPES; i++) {
 		if (i == PACKET_TYPE_NONE) {
@@ -37,10 +39,45 @@ void stats_serialize(struct packet *packet, struct buf *buf) {
 	}
 	struct timespec now;
 	assert(!clock_gettime(CLOCK_MONOTONIC_COARSE, &now));
-	json_t *out = json_pack("{sIso}",
+	stats_to_buf(json_pack("{sIso}",
 			"uptime_seconds", (json_int_t) (now.tv_sec - stats_state.start.tv_sec),
-			"packet_counts", counts);
-	assert(json_dump_callback(out, json_buf_append_callback, buf, 0) == 0);
-	json_decref(out);
-	buf_chr(buf, buf->length++) = '\n';
+			"packet_counts", counts), 0, buf);
+}
+
+static void stats_serialize_stages(struct buf *buf) {
+	// Separate record with short keys and compact separators: every field at
+	// full width still fits in BUF_LEN_MAX, which the counts record plus
+	// these would not.
+	json_t *out = json_object();
+	if (crc_enabled()) {
+		json_t *crc_counts = json_object();
+		for (int i = 0; i < NUM_CRC_RESULTS; i++) {
+			json_object_set_new(crc_counts, crc_result_names[i], json_integer((json_int_t) crc_totals[i]));
+		}
+		json_object_set_new(out, "crc", crc_counts);
+	}
+	if (aircraft_enabled()) {
+		json_object_set_new(out, "aircraft", json_integer((json_int_t) aircraft_count()));
+	}
+	if (dedup_enabled()) {
+		uint64_t total = dedup_unique_count + dedup_duplicate_count;
+		json_object_set_new(out, "dedup", json_pack("{sIsIsI}",
+				"unique", (json_int_t) dedup_unique_count,
+				"duplicate", (json_int_t) dedup_duplicate_count,
+				"per_mille", (json_int_t) (total ? (double) dedup_duplicate_count * 1000 / (double) total : 0)));
+	}
+	stats_to_buf(out, JSON_COMPACT, buf);
+}
+
+void stats_serialize(struct packet *packet, struct buf *buf) {
+	if (packet) {
+		stats_state.total_count++;
+		stats_state.type_count[packet->type]++;
+	}
+	if (stats_state.total_count % 1000 == 0) {
+		stats_serialize_counts(buf);
+	} else if (stats_state.total_count % 1000 == 1 && stats_state.total_count > 1 &&
+			(crc_enabled() || aircraft_enabled() || dedup_enabled())) {
+		stats_serialize_stages(buf);
+	}
 }
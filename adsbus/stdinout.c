@@ -1,5 +1,11 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,6 +19,14 @@
 
 static opts_group stdinout_opts;
 
+// Sends make pipes and sockets O_NONBLOCK, which is a property of the file
+// description. A dup of stdout shares that with our parent and anyone else
+// holding it, so stdout sends write to a pipe of our own instead, and this
+// thread copies it to the real (untouched, possibly blocking) stdout.
+static int stdinout_relay_fd = -1;
+static int stdinout_relay_out_fd;
+static pthread_t stdinout_relay_thread;
+
 static void stdinout_open(int fd, char *path, int flags) {
 	assert(open(path, flags | O_CLOEXEC | O_NOCTTY) == fd);
 }
@@ -23,6 +37,91 @@ static void stdinout_reopen(int fd, char *path, int flags) {
 	stdinout_open(fd, path, flags);
 }
 
+static bool stdinout_relay_wait(int fd) {
+	struct pollfd pollfd = {
+		.fd = fd,
+		.events = POLLOUT,
+	};
+	return poll(&pollfd, 1, -1) == 1 && !(pollfd.revents & (POLLERR | POLLHUP));
+}
+
+static bool stdinout_relay_copy(int in_fd, int out_fd) {
+	// For outputs splice() won't take (e.g. O_APPEND files)
+	uint8_t buf[65536];
+	ssize_t len = read(in_fd, buf, sizeof(buf));
+	if (len <= 0) {
+		return false;
+	}
+	for (ssize_t done = 0; done < len;) {
+		ssize_t res = write(out_fd, &buf[done], (size_t) (len - done));
+		if (res == -1 && errno == EAGAIN && stdinout_relay_wait(out_fd)) {
+			continue;
+		}
+		if (res <= 0) {
+			return false;
+		}
+		done += res;
+	}
+	return true;
+}
+
+static void *stdinout_relay_main(void *arg) {
+	int in_fd = (int) (intptr_t) arg;
+
+	sigset_t sigmask;
+	assert(!sigfillset(&sigmask));
+	assert(!pthread_sigmask(SIG_BLOCK, &sigmask, NULL));
+
+	int out_fd = stdinout_relay_out_fd;
+	bool use_splice = true;
+	while (true) {
+		if (use_splice) {
+			ssize_t len = splice(in_fd, NULL, out_fd, NULL, 65536, SPLICE_F_MOVE);
+			if (len > 0) {
+				continue;
+			}
+			if (len == -1 && errno == EAGAIN && stdinout_relay_wait(out_fd)) {
+				continue;
+			}
+			if (len == -1 && errno == EINVAL) {
+				use_splice = false;
+				continue;
+			}
+			break;
+		}
+		if (!stdinout_relay_copy(in_fd, out_fd)) {
+			break;
+		}
+	}
+	// Any sends still writing get EPIPE
+	assert(!close(in_fd));
+	assert(!close(out_fd));
+	return NULL;
+}
+
+static int stdinout_stdout_fd() {
+	struct stat st;
+	assert(!fstat(STDOUT_FILENO, &st));
+	if (isatty(STDOUT_FILENO) || S_ISREG(st.st_mode)) {
+		// Sends leave these blocking
+		int fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		assert(fd >= 0);
+		return fd;
+	}
+	if (stdinout_relay_fd == -1) {
+		int fds[2];
+		assert(!pipe2(fds, O_CLOEXEC));
+		stdinout_relay_fd = fds[1];
+		// Before stdinout_init() replaces STDOUT_FILENO
+		stdinout_relay_out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		assert(stdinout_relay_out_fd >= 0);
+		assert(!pthread_create(&stdinout_relay_thread, NULL, stdinout_relay_main, (void *) (intptr_t) fds[0]));
+	}
+	int fd = fcntl(stdinout_relay_fd, F_DUPFD_CLOEXEC, 0);
+	assert(fd >= 0);
+	return fd;
+}
+
 static bool stdinout_stdin(const char __attribute__((unused)) *arg) {
 	int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
 	assert(fd >= 0);
@@ -30,13 +129,11 @@ static bool stdinout_stdin(const char __attribute__((unused)) *arg) {
 }
 
 static bool stdinout_stdout(const char *arg) {
-	struct serializer *serializer = send_get_serializer(arg);
-	if (!serializer) {
+	void *output = send_get_output(arg);
+	if (!output) {
 		return false;
 	}
-	int fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
-	assert(fd >= 0);
-	return flow_new_send_hello(fd, send_flow, serializer, NULL);
+	return flow_new_send_hello(stdinout_stdout_fd(), send_flow, output, NULL);
 }
 
 void stdinout_preinit() {
@@ -50,7 +147,7 @@ void stdinout_preinit() {
 
 void stdinout_opts_add() {
 	opts_add("stdin", NULL, stdinout_stdin, stdinout_opts);
-	opts_add("stdout", "FORMAT", stdinout_stdout, stdinout_opts);
+	opts_add("stdout", "FORMAT[,OPTION=VALUE...]", stdinout_stdout, stdinout_opts);
 }
 
 void stdinout_init() {
@@ -60,6 +157,11 @@ void stdinout_init() {
 }
 
 void stdinout_cleanup() {
+	if (stdinout_relay_fd != -1) {
+		// Sends are gone; the relay drains the pipe and exits
+		assert(!close(stdinout_relay_fd));
+		assert(!pthread_join(stdinout_relay_thread, NULL));
+	}
 	assert(!close(STDIN_FILENO));
 	assert(!close(STDOUT_FILENO));
 }